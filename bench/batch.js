@@ -0,0 +1,68 @@
+/*
+ throughput of one load -> resizeByWidth -> toBuffer call per image
+ against NodeMagick.batch() over the same images.
+
+ usage: node bench/batch.js path_to_image [jobs]
+*/
+var NodeMagick = require( __dirname + '/../index' ),
+    src = process.argv[2],
+    njob = +process.argv[3] || 1024;
+
+if( !src ){
+    console.log( 'usage: node bench/batch.js path_to_image [jobs]' );
+    process.exit(1);
+}
+
+function perCall( cb )
+{
+    var start = Date.now(),
+        done = 0,
+        i;
+
+    for( i = 0; i < njob; i++ )
+    {
+        (function(){
+            var img = new NodeMagick();
+
+            img.load( src, { lazy: true }, function( err ){
+                if( err ){
+                    throw err;
+                }
+                img.resizeByWidth( 64 );
+                img.toBuffer( function( err ){
+                    if( err ){
+                        throw err;
+                    }
+                    if( ++done === njob ){
+                        cb( Date.now() - start );
+                    }
+                });
+            });
+        })();
+    }
+}
+
+function batch( cb )
+{
+    var start = Date.now(),
+        jobs = [],
+        i;
+
+    for( i = 0; i < njob; i++ ){
+        jobs.push({ src: src, width: 64 });
+    }
+    NodeMagick.batch( jobs, { progress: function(){}, every: 128 }, function( err, summary ){
+        if( err || summary.failed ){
+            throw err || new Error( summary.failed + ' jobs failed' );
+        }
+        cb( Date.now() - start );
+    });
+}
+
+perCall( function( a ){
+    console.log( 'per call:\t' + ( njob / ( a / 1000 ) ).toFixed(2) + ' images/sec' );
+    batch( function( b ){
+        console.log( 'batch:\t\t' + ( njob / ( b / 1000 ) ).toFixed(2) + ' images/sec' +
+                     '\tx' + ( a / b ).toFixed(2) );
+    });
+});
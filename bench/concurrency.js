@@ -0,0 +1,68 @@
+/*
+ throughput of async load -> resizeByWidth -> save while raising
+ NodeMagick.maxConcurrency from 1 to the number of cpus.
+ 
+ usage: node bench/concurrency.js path_to_image [jobs]
+*/
+var os = require('os'),
+    NodeMagick = require( __dirname + '/../index' ),
+    src = process.argv[2],
+    njob = +process.argv[3] || 64,
+    ncpu = os.cpus().length,
+    levels = [];
+
+if( !src ){
+    console.log( 'usage: node bench/concurrency.js path_to_image [jobs]' );
+    process.exit(1);
+}
+
+for( var n = 1; n < ncpu; n *= 2 ){
+    levels.push( n );
+}
+levels.push( ncpu );
+
+function job( idx, cb )
+{
+    var img = new NodeMagick();
+    
+    img.load( src, function( err ){
+        if( err ){
+            return cb( err );
+        }
+        img.resizeByWidth( 256 );
+        img.save( '/tmp/NodeMagick-bench-' + idx + '.jpg', cb );
+    });
+}
+
+function run( level, cb )
+{
+    var start = Date.now(),
+        done = 0,
+        i;
+    
+    NodeMagick.maxConcurrency = level;
+    for( i = 0; i < njob; i++ )
+    {
+        job( i, function( err ){
+            if( err ){
+                throw err;
+            }
+            if( ++done === njob ){
+                cb( njob / ( ( Date.now() - start ) / 1000 ) );
+            }
+        });
+    }
+}
+
+(function next( idx, base ){
+    if( idx < levels.length )
+    {
+        run( levels[idx], function( ips ){
+            base = base || ips;
+            console.log( 'maxConcurrency: ' + levels[idx] + 
+                         '\t' + ips.toFixed(2) + ' images/sec' + 
+                         '\tx' + ( ips / base ).toFixed(2) );
+            next( idx + 1, base );
+        });
+    }
+})( 0, 0 );
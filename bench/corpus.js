@@ -0,0 +1,90 @@
+/*
+ generate the synthetic benchmark corpus into bench/corpus.
+ images are rendered from a seeded pattern (gradients, blocks and noise)
+ so every run produces the same files.
+ 
+ usage: node bench/corpus.js
+*/
+var fs = require('fs'),
+    path = require('path'),
+    NodeMagick = require( __dirname + '/../index' ),
+    dir = __dirname + '/corpus',
+    FORMATS = [ 'jpg', 'png', 'gif', 'webp' ],
+    SIZES = [
+        [ 640, 480 ],
+        [ 1920, 1080 ],
+        [ 4000, 3000 ]
+    ];
+
+// deterministic pseudo random
+function prng( seed )
+{
+    return function(){
+        seed = ( seed * 1103515245 + 12345 ) & 0x7fffffff;
+        return seed / 0x7fffffff;
+    };
+}
+
+// render binary pixmap
+function pattern( w, h, seed )
+{
+    var header = 'P6\n' + w + ' ' + h + '\n255\n',
+        buf = new Buffer( header.length + w * h * 3 ),
+        rand = prng( seed ),
+        blocks = [],
+        pos = header.length,
+        x, y, i, b, r, g, bl, n;
+    
+    buf.write( header, 0, 'ascii' );
+    for( i = 0; i < 24; i++ ){
+        blocks.push({
+            x: rand() * w, y: rand() * h,
+            w: rand() * w / 4, h: rand() * h / 4,
+            r: rand() * 255, g: rand() * 255, b: rand() * 255
+        });
+    }
+    
+    for( y = 0; y < h; y++ )
+    {
+        for( x = 0; x < w; x++ )
+        {
+            r = x / w * 255;
+            g = y / h * 255;
+            bl = ( x + y ) / ( w + h ) * 255;
+            for( i = 0; i < blocks.length; i++ )
+            {
+                b = blocks[i];
+                if( x >= b.x && x < b.x + b.w && y >= b.y && y < b.y + b.h ){
+                    r = b.r; g = b.g; bl = b.b;
+                }
+            }
+            n = ( rand() - 0.5 ) * 24;
+            buf[pos++] = Math.max( 0, Math.min( 255, r + n ) );
+            buf[pos++] = Math.max( 0, Math.min( 255, g + n ) );
+            buf[pos++] = Math.max( 0, Math.min( 255, bl + n ) );
+        }
+    }
+    
+    return buf;
+}
+
+try {
+    fs.mkdirSync( dir, 0755 );
+}
+catch( e ){}
+
+SIZES.forEach( function( size, idx )
+{
+    var src = pattern( size[0], size[1], idx + 1 );
+    
+    FORMATS.forEach( function( ext )
+    {
+        var file = path.join( dir, size[0] + 'x' + size[1] + '.' + ext ),
+            img = new NodeMagick();
+        
+        img.load( src );
+        img.quality = 90;
+        img.save( file );
+        console.log( file + '\t' + fs.statSync( file ).size + ' bytes' );
+    });
+});
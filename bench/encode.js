@@ -0,0 +1,50 @@
+/*
+ output bytes and encode time of encoder presets.
+
+ usage: node bench/encode.js path_to_image [width] [runs]
+*/
+var NodeMagick = require( __dirname + '/../index' ),
+    src = process.argv[2],
+    width = +process.argv[3] || 1024,
+    runs = +process.argv[4] || 5,
+    presets = [
+        { name: 'jpeg default', format: 'jpeg', opts: {} },
+        { name: 'jpeg progressive', format: 'jpeg', opts: { progressive: true } },
+        { name: 'jpeg 4:2:0 optimized', format: 'jpeg', opts: { sampling: '2x2,1x1,1x1', optimize: true } },
+        { name: 'jpeg progressive 4:2:0', format: 'jpeg', opts: { progressive: true, sampling: '2x2,1x1,1x1', optimize: true } },
+        { name: 'png default', format: 'png', opts: {} },
+        { name: 'png level 1', format: 'png', opts: { level: 1 } },
+        { name: 'png level 9 paeth', format: 'png', opts: { level: 9, pngFilter: 4 } },
+        { name: 'png 256 colors', format: 'png', opts: { level: 9, colors: 256 } },
+        { name: 'webp method 0', format: 'webp', opts: { method: 0 } },
+        { name: 'webp method 6', format: 'webp', opts: { method: 6 } },
+        { name: 'webp near-lossless 60', format: 'webp', opts: { lossless: true, nearLossless: 60 } },
+        { name: 'webp lossless', format: 'webp', opts: { lossless: true, method: 4 } }
+    ];
+
+if( !src ){
+    console.log( 'usage: node bench/encode.js path_to_image [width] [runs]' );
+    process.exit(1);
+}
+
+presets.forEach( function( preset )
+{
+    var elapsed = 0,
+        bytes = 0,
+        img, i;
+
+    for( i = 0; i < runs; i++ )
+    {
+        img = new NodeMagick();
+        img.load( src );
+        img.resizeByWidth( width );
+        img.format = preset.format;
+        img.quality = 82;
+        bytes = img.toBuffer( preset.opts ).length;
+        elapsed += img.jobStats.encode;
+    }
+
+    console.log( preset.name +
+                 '\t' + ( bytes / 1024 ).toFixed(1) + ' KB' +
+                 '\tencode ' + ( elapsed / runs ).toFixed(2) + ' ms' );
+});
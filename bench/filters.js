@@ -0,0 +1,49 @@
+/*
+ time and output size of every resampling filter and the thumbnail mode
+ for a single resize of the same source.
+ 
+ usage: node bench/filters.js path_to_image [width] [runs]
+*/
+var NodeMagick = require( __dirname + '/../index' ),
+    src = process.argv[2],
+    width = +process.argv[3] || 256,
+    runs = +process.argv[4] || 10,
+    filters = [ 'sample', 'point', 'box', 'triangle', 'hermite', 'catrom', 
+                'mitchell', 'robidoux', 'lanczos2', 'lanczos' ],
+    cases = [];
+
+if( !src ){
+    console.log( 'usage: node bench/filters.js path_to_image [width] [runs]' );
+    process.exit(1);
+}
+
+filters.forEach( function( filter ){
+    cases.push( { filter: filter, thumbnail: false } );
+});
+filters.forEach( function( filter ){
+    if( filter !== 'sample' ){
+        cases.push( { filter: filter, thumbnail: true } );
+    }
+});
+
+cases.forEach( function( c )
+{
+    var elapsed = 0,
+        bytes = 0,
+        img, start, i;
+    
+    for( i = 0; i < runs; i++ )
+    {
+        img = new NodeMagick();
+        img.load( src );
+        img.filter = c.filter;
+        img.thumbnail = c.thumbnail;
+        img.resizeByWidth( width );
+        start = Date.now();
+        bytes = img.toBuffer().length;
+        elapsed += Date.now() - start;
+    }
+    console.log( ( c.thumbnail ? 'thumbnail+' : '' ) + c.filter + 
+                 '\t' + ( elapsed / runs ).toFixed(2) + ' ms' + 
+                 '\t' + bytes + ' bytes' );
+});
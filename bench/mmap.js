@@ -0,0 +1,42 @@
+/*
+ load time and resident memory of the path based reader against
+ the memory mapped one.
+
+ usage: node bench/mmap.js path_to_image [runs]
+*/
+var NodeMagick = require( __dirname + '/../index' ),
+    src = process.argv[2],
+    runs = +process.argv[3] || 10;
+
+if( !src ){
+    console.log( 'usage: node bench/mmap.js path_to_image [runs]' );
+    process.exit(1);
+}
+
+function load( mmap )
+{
+    var elapsed = 0,
+        peak = 0,
+        rss = process.memoryUsage().rss,
+        img, i;
+
+    for( i = 0; i < runs; i++ )
+    {
+        img = new NodeMagick();
+        img.load( src, { mmap: mmap } );
+        elapsed += img.jobStats.decode;
+        peak = Math.max( peak, process.memoryUsage().rss - rss );
+        img.dispose();
+    }
+
+    return { msec: elapsed / runs, rss: peak };
+}
+
+[ false, true, false, true ].forEach( function( mmap )
+{
+    var res = load( mmap );
+
+    console.log( ( mmap ? 'mmap' : 'path' ) +
+                 '\tdecode ' + res.msec.toFixed(2) + ' ms' +
+                 '\trss +' + ( res.rss / 1048576 ).toFixed(1) + ' MB' );
+});
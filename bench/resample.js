@@ -0,0 +1,67 @@
+/*
+ resize time of the native resampler against ImageMagick for every
+ filter it supports, and how far their outputs are apart.
+
+ usage: node bench/resample.js path_to_image [width] [runs]
+*/
+var NodeMagick = require( __dirname + '/../index' ),
+    src = process.argv[2],
+    width = +process.argv[3] || 256,
+    runs = +process.argv[4] || 10,
+    filters = [ 'sample', 'box', 'triangle', 'hermite', 'catrom', 'mitchell', 'lanczos' ],
+    native = NodeMagick.resampler;
+
+if( !src ){
+    console.log( 'usage: node bench/resample.js path_to_image [width] [runs]' );
+    process.exit(1);
+}
+
+function resize( resampler, filter )
+{
+    var elapsed = 0,
+        img, pixels, i;
+
+    NodeMagick.resampler = resampler;
+    for( i = 0; i < runs; i++ )
+    {
+        img = new NodeMagick();
+        img.load( src );
+        img.filter = filter;
+        img.resizeByWidth( width );
+        pixels = img.getPixels({ map: 'RGB' });
+        elapsed += img.jobStats.resize;
+    }
+
+    return { msec: elapsed / runs, pixels: pixels };
+}
+
+// mean and max absolute difference per channel
+function diff( a, b )
+{
+    var sum = 0,
+        max = 0,
+        d, i;
+
+    for( i = 0; i < a.length; i++ ){
+        d = Math.abs( a[i] - b[i] );
+        sum += d;
+        max = Math.max( max, d );
+    }
+
+    return { mean: sum / a.length, max: max };
+}
+
+console.log( 'native kernel: ' + native );
+filters.forEach( function( filter )
+{
+    var magick = resize( 'magick', filter ),
+        fast = resize( native, filter ),
+        d = diff( magick.pixels, fast.pixels );
+
+    console.log( filter +
+                 '\tmagick ' + magick.msec.toFixed(2) + ' ms' +
+                 '\tnative ' + fast.msec.toFixed(2) + ' ms' +
+                 '\tx' + ( magick.msec / fast.msec ).toFixed(2) +
+                 '\tdiff mean ' + d.mean.toFixed(3) + ' max ' + d.max );
+});
+NodeMagick.resampler = native;
@@ -0,0 +1,174 @@
+/*
+ benchmark load -> crop -> resizeByWidth -> save over the corpus made by
+ bench/corpus.js, in sync mode and in async mode at several concurrency
+ levels.
+ 
+ usage: node bench/run.js [--iterations=N] [--only=substring] [--json]
+ 
+ every scenario reports images/sec, p50/p99 latency in milliseconds and
+ peak rss in bytes. --json prints the results as a single JSON document
+ for comparing runs.
+*/
+var fs = require('fs'),
+    os = require('os'),
+    path = require('path'),
+    NodeMagick = require( __dirname + '/../index' ),
+    dir = __dirname + '/corpus',
+    opts = { iterations: 20, only: '', json: false },
+    ncpu = os.cpus().length,
+    levels = [ 1 ],
+    scenarios = [],
+    results = [];
+
+process.argv.slice(2).forEach( function( arg ){
+    var kv = arg.replace( /^--/, '' ).split( '=' );
+    opts[kv[0]] = ( kv.length > 1 ) ? kv[1] : true;
+});
+opts.iterations = +opts.iterations;
+
+for( var n = 2; n < ncpu; n *= 2 ){
+    levels.push( n );
+}
+if( ncpu > 1 ){
+    levels.push( ncpu );
+}
+
+fs.readdirSync( dir ).sort().forEach( function( file )
+{
+    scenarios.push( { file: file, mode: 'sync', concurrency: 1 } );
+    levels.forEach( function( level ){
+        scenarios.push( { file: file, mode: 'async', concurrency: level } );
+    });
+});
+scenarios = scenarios.filter( function( s ){
+    return ( s.file + ' ' + s.mode ).indexOf( opts.only ) !== -1;
+});
+
+function percentile( sorted, p )
+{
+    return sorted[Math.min( sorted.length - 1, Math.floor( sorted.length * p ) )];
+}
+
+function output( file, idx )
+{
+    return '/tmp/NodeMagick-bench-' + idx + path.extname( file );
+}
+
+function prepare( img )
+{
+    img.crop( 1, 2 );
+    img.resizeByWidth( 256 );
+}
+
+function runSync( s, cb )
+{
+    var src = path.join( dir, s.file ),
+        latency = [],
+        peak = 0,
+        i, img, t;
+    
+    for( i = 0; i < opts.iterations; i++ )
+    {
+        t = Date.now();
+        img = new NodeMagick();
+        img.load( src );
+        prepare( img );
+        img.save( output( s.file, 0 ) );
+        latency.push( Date.now() - t );
+        peak = Math.max( peak, process.memoryUsage().rss );
+    }
+    cb( latency, peak );
+}
+
+function runAsync( s, cb )
+{
+    var src = path.join( dir, s.file ),
+        latency = [],
+        peak = 0,
+        started = 0,
+        timer = setInterval( function(){
+            peak = Math.max( peak, process.memoryUsage().rss );
+        }, 10 );
+    
+    function next( slot )
+    {
+        var img = new NodeMagick(),
+            t = Date.now();
+        
+        started++;
+        img.load( src, function( err )
+        {
+            if( err ){
+                throw err;
+            }
+            prepare( img );
+            img.save( output( s.file, slot ), function( err )
+            {
+                if( err ){
+                    throw err;
+                }
+                latency.push( Date.now() - t );
+                if( started < opts.iterations ){
+                    next( slot );
+                }
+                else if( latency.length === opts.iterations ){
+                    clearInterval( timer );
+                    peak = Math.max( peak, process.memoryUsage().rss );
+                    cb( latency, peak );
+                }
+            });
+        });
+    }
+    
+    NodeMagick.maxConcurrency = s.concurrency;
+    for( var i = 0; i < s.concurrency && started < opts.iterations; i++ ){
+        next( i );
+    }
+}
+
+(function next( idx )
+{
+    var s = scenarios[idx],
+        start;
+    
+    if( !s )
+    {
+        if( opts.json ){
+            console.log( JSON.stringify({
+                date: new Date().toISOString(),
+                node: process.version,
+                platform: process.platform,
+                cpus: ncpu,
+                iterations: opts.iterations,
+                results: results
+            }, null, 2 ) );
+        }
+        return;
+    }
+    
+    start = Date.now();
+    ( ( s.mode === 'sync' ) ? runSync : runAsync )( s, function( latency, peak )
+    {
+        var elapsed = ( Date.now() - start ) / 1000,
+            sorted = latency.slice().sort( function( a, b ){ return a - b; } ),
+            r = {
+                file: s.file,
+                mode: s.mode,
+                concurrency: s.concurrency,
+                images: latency.length,
+                imagesPerSec: latency.length / elapsed,
+                p50: percentile( sorted, 0.5 ),
+                p99: percentile( sorted, 0.99 ),
+                peakRss: peak
+            };
+        
+        results.push( r );
+        if( !opts.json ){
+            console.log( [ r.file, r.mode, 'c=' + r.concurrency, 
+                           r.imagesPerSec.toFixed(2) + ' img/s', 
+                           'p50=' + r.p50 + 'ms', 'p99=' + r.p99 + 'ms', 
+                           'rss=' + ( r.peakRss / 1048576 ).toFixed(1) + 'MB' ].join( '\t' ) );
+        }
+        next( idx + 1 );
+    });
+})( 0 );
@@ -0,0 +1,279 @@
+/*
+ icc to sRGB conversion through lcms2
+
+ building a transform parses both profiles and precomputes lookup
+ tables, which costs more than converting a large image. transforms are
+ kept in a small LRU cache keyed by a hash of the source profile and
+ shared by all threads; an entry is only evicted when no thread is
+ converting with it.
+*/
+#include "ColorTransform.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_LCMS2
+#include <lcms2.h>
+
+#define CACHE_SIZE 16
+// cmsDoTransform takes a 32-bit pixel count
+#define CHUNK_PIXELS ( 1UL << 24 )
+
+typedef struct {
+    cmsColorSpaceSignature space;
+    cmsUInt32Number in;
+    cmsUInt32Number out;
+    // samples per input pixel, alpha is the last one
+    unsigned int channels;
+    int alpha;
+} Layout_t;
+
+static const Layout_t LAYOUTS[] = {
+    { cmsSigGrayData, TYPE_GRAY_16, TYPE_RGB_16, 1, 0 },
+    { cmsSigGrayData, TYPE_GRAYA_16, TYPE_RGBA_16, 2, 1 },
+    { cmsSigRgbData, TYPE_RGB_16, TYPE_RGB_16, 3, 0 },
+    { cmsSigRgbData, TYPE_RGBA_16, TYPE_RGBA_16, 4, 1 },
+    { cmsSigCmykData, TYPE_CMYK_16, TYPE_RGB_16, 4, 0 },
+    { cmsSigCmykData, COLORSPACE_SH(PT_CMYK)|EXTRA_SH(1)|CHANNELS_SH(4)|BYTES_SH(2), TYPE_RGBA_16, 5, 1 }
+};
+
+typedef struct {
+    unsigned long long key;
+    size_t len;
+    ColorLayout_e layout;
+    cmsHTRANSFORM xform;
+    // threads converting with it
+    unsigned int refs;
+    unsigned long used;
+} Transform_t;
+
+static struct {
+    pthread_mutex_t lock;
+    Transform_t entries[CACHE_SIZE];
+    unsigned int count;
+    unsigned long tick;
+    double hits;
+    double misses;
+} cache = { PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t srgbOnce = PTHREAD_ONCE_INIT;
+static unsigned char *srgb = NULL;
+static size_t srgbLen = 0;
+
+// FNV-1a
+static unsigned long long hashProfile( const void *data, size_t len )
+{
+    const unsigned char *p = (const unsigned char*)data;
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i;
+
+    for( i = 0; i < len; i++ ){
+        hash = ( hash ^ p[i] ) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static cmsHTRANSFORM createTransform( const void *icc, size_t len, ColorLayout_e layout )
+{
+    cmsHPROFILE in = cmsOpenProfileFromMem( icc, len );
+    cmsHPROFILE out;
+    cmsHTRANSFORM xform = NULL;
+
+    if( !in ){
+        return NULL;
+    }
+    // the profile must describe the pixels it is attached to
+    if( cmsGetColorSpace( in ) == LAYOUTS[layout].space &&
+        ( out = cmsCreate_sRGBProfile() ) )
+    {
+        // no 1-pixel cache, the transform is shared between threads
+        xform = cmsCreateTransform( in, LAYOUTS[layout].in, out, LAYOUTS[layout].out,
+                                    INTENT_PERCEPTUAL, cmsFLAGS_NOCACHE );
+        cmsCloseProfile( out );
+    }
+    cmsCloseProfile( in );
+
+    return xform;
+}
+
+static Transform_t *findTransform( unsigned long long key, size_t len, ColorLayout_e layout )
+{
+    unsigned int i;
+
+    for( i = 0; i < cache.count; i++ )
+    {
+        Transform_t *entry = &cache.entries[i];
+
+        if( entry->key == key && entry->len == len && entry->layout == layout ){
+            entry->refs++;
+            entry->used = ++cache.tick;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// free slot or least recently used idle one, NULL if all are busy
+static Transform_t *cacheSlot( void )
+{
+    Transform_t *victim = NULL;
+    unsigned int i;
+
+    if( cache.count < CACHE_SIZE ){
+        return &cache.entries[cache.count++];
+    }
+    for( i = 0; i < CACHE_SIZE; i++ )
+    {
+        if( !cache.entries[i].refs &&
+            ( !victim || cache.entries[i].used < victim->used ) ){
+            victim = &cache.entries[i];
+        }
+    }
+    if( victim ){
+        cmsDeleteTransform( victim->xform );
+    }
+    return victim;
+}
+
+static void createSRGB( void )
+{
+    cmsHPROFILE profile = cmsCreate_sRGBProfile();
+    cmsUInt32Number len = 0;
+
+    if( !profile ){
+        return;
+    }
+    if( cmsSaveProfileToMem( profile, NULL, &len ) && len &&
+        ( srgb = (unsigned char*)malloc( len ) ) )
+    {
+        if( cmsSaveProfileToMem( profile, srgb, &len ) ){
+            srgbLen = len;
+        }
+        else {
+            free( srgb );
+            srgb = NULL;
+        }
+    }
+    cmsCloseProfile( profile );
+}
+
+int colorAvailable( void )
+{
+    return 1;
+}
+
+int colorToSRGB( const void *icc, size_t icclen, ColorLayout_e layout,
+                 const unsigned short *src, unsigned short *dst, unsigned long npix )
+{
+    const Layout_t *l = &LAYOUTS[layout];
+    unsigned long long key = hashProfile( icc, icclen );
+    unsigned int outch = ( l->alpha ) ? 4 : 3;
+    Transform_t *entry;
+    cmsHTRANSFORM xform = NULL;
+    unsigned long i, n;
+
+    pthread_mutex_lock( &cache.lock );
+    if( ( entry = findTransform( key, icclen, layout ) ) ){
+        cache.hits++;
+    }
+    else {
+        cache.misses++;
+    }
+    pthread_mutex_unlock( &cache.lock );
+
+    // built outside the lock, other profiles stay usable meanwhile
+    if( !entry )
+    {
+        if( !( xform = createTransform( icc, icclen, layout ) ) ){
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock( &cache.lock );
+        // lost the race to another thread
+        if( ( entry = findTransform( key, icclen, layout ) ) ){
+            cmsDeleteTransform( xform );
+            xform = NULL;
+        }
+        else if( ( entry = cacheSlot() ) ){
+            entry->key = key;
+            entry->len = icclen;
+            entry->layout = layout;
+            entry->xform = xform;
+            entry->refs = 1;
+            entry->used = ++cache.tick;
+            xform = NULL;
+        }
+        pthread_mutex_unlock( &cache.lock );
+    }
+
+    for( i = 0; i < npix; i += n )
+    {
+        n = ( npix - i < CHUNK_PIXELS ) ? npix - i : CHUNK_PIXELS;
+        cmsDoTransform( ( entry ) ? entry->xform : xform,
+                        src + i * l->channels, dst + i * outch, (cmsUInt32Number)n );
+    }
+    // lcms leaves extra channels alone
+    if( l->alpha ){
+        for( i = 0; i < npix; i++ ){
+            dst[i * 4 + 3] = src[i * l->channels + l->channels - 1];
+        }
+    }
+
+    // all slots busy, was not cached
+    if( xform ){
+        cmsDeleteTransform( xform );
+    }
+    else {
+        pthread_mutex_lock( &cache.lock );
+        entry->refs--;
+        pthread_mutex_unlock( &cache.lock );
+    }
+
+    return 0;
+}
+
+const unsigned char *colorSRGBProfile( size_t *len )
+{
+    pthread_once( &srgbOnce, createSRGB );
+    *len = srgbLen;
+    return srgb;
+}
+
+void colorCacheStats( double *hits, double *misses, unsigned int *entries )
+{
+    pthread_mutex_lock( &cache.lock );
+    *hits = cache.hits;
+    *misses = cache.misses;
+    *entries = cache.count;
+    pthread_mutex_unlock( &cache.lock );
+}
+
+#else
+
+int colorAvailable( void )
+{
+    return 0;
+}
+
+int colorToSRGB( const void *, size_t, ColorLayout_e,
+                 const unsigned short *, unsigned short *, unsigned long )
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+const unsigned char *colorSRGBProfile( size_t *len )
+{
+    *len = 0;
+    return NULL;
+}
+
+void colorCacheStats( double *hits, double *misses, unsigned int *entries )
+{
+    *hits = *misses = 0;
+    *entries = 0;
+}
+
+#endif
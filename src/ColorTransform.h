@@ -0,0 +1,35 @@
+/*
+ conversion of packed 16-bit pixels from an embedded icc profile to sRGB
+*/
+#ifndef ___COLORTRANSFORM_H___
+#define ___COLORTRANSFORM_H___
+
+#include <stddef.h>
+
+typedef enum {
+    COLOR_GRAY,
+    COLOR_GRAYA,
+    COLOR_RGB,
+    COLOR_RGBA,
+    COLOR_CMYK,
+    COLOR_CMYKA
+} ColorLayout_e;
+
+// 1 if built with lcms2
+int colorAvailable( void );
+
+// convert npix pixels of src laid out as layout and described by the
+// icc profile into sRGB. dst gets 3 samples per pixel, 4 if layout has
+// alpha, which is copied unchanged. transforms are cached by profile
+// hash. returns -1 and sets errno on failure: ENOTSUP without lcms2,
+// EINVAL if the profile does not describe layout.
+int colorToSRGB( const void *icc, size_t icclen, ColorLayout_e layout,
+                 const unsigned short *src, unsigned short *dst, unsigned long npix );
+
+// sRGB profile embedded by keep-icc saves, NULL without lcms2
+const unsigned char *colorSRGBProfile( size_t *len );
+
+// cached transforms
+void colorCacheStats( double *hits, double *misses, unsigned int *entries );
+
+#endif
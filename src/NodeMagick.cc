@@ -1,16 +1,28 @@
 #include <node.h>
 #include <node_events.h>
+#include <node_buffer.h>
 
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
 
 #include <cstring>
+#include <strings.h>
 #include <typeinfo>
 #include <pthread.h>
 #include "wand/MagickWand.h"
+#include "Resample.h"
+#include "ColorTransform.h"
+#include "Placeholder.h"
 
 using namespace v8;
 using namespace node;
@@ -23,7 +35,7 @@ using namespace node;
   ExceptionType severity; \
   char *desc = MagickGetException( wand, &severity ); \
   printf("error: %s\n",desc); \
-  str = String::New(desc); \
+  str = strdup(desc); \
   MagickRelinquishMemory(desc); \
 })
 
@@ -44,23 +56,488 @@ typedef struct {
     double aspect;
 } ImageSize;
 
+// operations recorded by crop/resize/rotate/... and run by saveImage
+typedef enum {
+    OP_CROP,
+    OP_RESIZE,
+    // crop folded into the resize source region by optimizeOps
+    OP_CROP_RESIZE,
+    OP_ROTATE,
+    OP_FLIP,
+    OP_FLOP,
+    OP_AUTO_ORIENT,
+    OP_SHARPEN,
+    OP_EXTEND
+} ImageOp_e;
+
+typedef struct {
+    ImageOp_e type;
+    // input geometry
+    unsigned long iw;
+    unsigned long ih;
+    // crop: region, resize/extend: output size and extend offset
+    long x;
+    long y;
+    unsigned long w;
+    unsigned long h;
+    // crop+resize: output size
+    unsigned long ow;
+    unsigned long oh;
+    // rotate: degrees, sharpen: radius and sigma, auto orient: 1 if transposed
+    double arg0;
+    double arg1;
+    // rotate/extend background
+    char color[32];
+} ImageOp_t;
+
+#define MAX_OPS 32
+
+// resampling filters by name, UndefinedFilter resizes by MagickSampleImage
+static const struct {
+    const char *name;
+    FilterTypes filter;
+} RESIZE_FILTERS[] = {
+    { "sample", UndefinedFilter },
+    { "point", PointFilter },
+    { "box", BoxFilter },
+    { "triangle", TriangleFilter },
+    { "hermite", HermiteFilter },
+    { "hanning", HanningFilter },
+    { "hamming", HammingFilter },
+    { "blackman", BlackmanFilter },
+    { "gaussian", GaussianFilter },
+    { "quadratic", QuadraticFilter },
+    { "cubic", CubicFilter },
+    { "catrom", CatromFilter },
+    { "mitchell", MitchellFilter },
+    { "lanczos", LanczosFilter },
+    { "lanczos2", Lanczos2Filter },
+    { "robidoux", RobidouxFilter },
+    { NULL, UndefinedFilter }
+};
+
 
 typedef enum ASYNC_TASK_BIT {
     ASYNC_TASK_LOAD = 1 << 0,
-    ASYNC_TASK_SAVE = 1 << 1
+    ASYNC_TASK_SAVE = 1 << 1,
+    ASYNC_TASK_TOBUFFER = 1 << 2,
+    ASYNC_TASK_PROBE = 1 << 3,
+    ASYNC_TASK_RENDITIONS = 1 << 4,
+    ASYNC_TASK_BATCH = 1 << 5,
+    ASYNC_TASK_GETPIXELS = 1 << 6,
+    ASYNC_TASK_SETPIXELS = 1 << 7,
+    // dispose() behind queued jobs of the instance, no callback
+    ASYNC_TASK_DISPOSE = 1 << 8
+};
+
+// image header fields read by probe
+typedef struct {
+    unsigned long w;
+    unsigned long h;
+    char *format;
+    int orientation;
+    unsigned long frames;
+} ProbeInfo_t;
+
+typedef struct {
+    // ping on load and decode on save with a size hint
+    int lazy;
+    // read files through a read-only mapping instead of stdio. the file
+    // must not shrink while it is decoded: a read past the new end raises
+    // SIGBUS and kills the process. use it for immutable inputs only.
+    int mmap;
+    // per job limits checked against the header before decoding, 0 = none
+    unsigned long maxwidth;
+    unsigned long maxheight;
+    double maxarea;
+    // animations: keep at most maxframes frames, every framestep-th
+    unsigned int maxframes;
+    unsigned int framestep;
+    // milliseconds from now, 0 = none
+    unsigned int deadline;
+} LoadOpts_t;
+
+// per save encoder settings, -1 = encoder default
+typedef struct {
+    // progressive jpeg, interlaced png/gif
+    int interlace;
+    // jpeg chroma subsampling, "4:2:0" or "2x2,1x1,1x1"
+    char sampling[32];
+    // jpeg optimized huffman tables
+    int optimize;
+    // png zlib level 0-9 and row filter 0-5
+    int level;
+    int pngfilter;
+    // quantize to a palette of at most colors, 0 = keep
+    unsigned long colors;
+    // webp effort 0-6, lossless and near-lossless 0-100
+    int method;
+    int lossless;
+    int nearlossless;
+    // highest quality down to minquality whose output fits, 0 = off
+    size_t maxbytes;
+    size_t minquality;
+    // convert embedded profile to sRGB before stripping
+    int srgb;
+    // keep the icc profile, drop exif/xmp/iptc/...
+    int keepicc;
+    // compute a placeholder of the output
+    int placeholder;
+    // milliseconds from now, 0 = instance deadline
+    unsigned int deadline;
+} EncodeOpts_t;
+
+// longest side of the rendition placeholders are computed from
+#define PLACEHOLDER_SIZE 32
+
+// BlurHash and dominant colour of an output
+typedef struct {
+    int valid;
+    char hash[64];
+    unsigned char color[3];
+} Placeholder_t;
+
+// one encode of the quality search
+#define MAX_PROBES 4
+typedef struct {
+    MagickWand *wand;
+    size_t quality;
+    int multi;
+    unsigned char *blob;
+    size_t len;
+} QualityProbe_t;
+
+
+// phases timed for every job
+typedef enum {
+    PHASE_QUEUE,
+    PHASE_DECODE,
+    PHASE_CROP,
+    PHASE_RESIZE,
+    PHASE_TRANSFORM,
+    PHASE_PROFILE,
+    PHASE_ENCODE,
+    PHASE_TOTAL,
+    PHASE_NUM
+} JobPhase_e;
+
+static const char *PHASE_NAMES[] = {
+    "queue",
+    "decode",
+    "crop",
+    "resize",
+    "transform",
+    "profile",
+    "encode",
+    "total"
+};
+
+typedef struct {
+    // milliseconds per phase
+    double msec[PHASE_NUM];
+    double bytesIn;
+    double bytesOut;
+    // estimated peak bytes of pixel cache
+    double peakPixels;
+} JobStats_t;
+
+// frames of an animation processed by several threads
+typedef struct {
+    void *ctx;
+    MagickWand **frames;
+    unsigned int nframes;
+    unsigned int next;
+    double ratio;
+    pthread_mutex_t lock;
+    // first error
+    char *errstr;
+    JobStats_t stats;
+} FrameJob_t;
+
+// cumulative counters and log2 latency histograms for stats()
+// bucket 0: < 1ms, bucket i: < 2^i ms, last bucket: rest
+#define STATS_BUCKETS 18
+static struct {
+    pthread_mutex_t lock;
+    double jobs;
+    double errors;
+    double bytesIn;
+    double bytesOut;
+    struct {
+        double count;
+        double sum;
+        double max;
+        double hist[STATS_BUCKETS];
+    } phase[PHASE_NUM];
+} stats;
+
+// recycled wands
+static struct {
+    pthread_mutex_t lock;
+    MagickWand **wands;
+    unsigned int count;
+    unsigned int max;
+    // bytes per pixel of the pixel cache
+    size_t pixelsize;
+} wandpool;
+
+// encoded outputs keyed by source hash and operation signature
+#define CACHE_BUCKETS 4096
+typedef struct CacheEntry_s {
+    unsigned long long key;
+    char *sig;
+    unsigned char *data;
+    size_t len;
+    // LRU, most recently used first
+    struct CacheEntry_s *prev;
+    struct CacheEntry_s *next;
+    struct CacheEntry_s *hnext;
+} CacheEntry_t;
+
+static struct {
+    pthread_mutex_t lock;
+    CacheEntry_t *table[CACHE_BUCKETS];
+    CacheEntry_t *head;
+    CacheEntry_t *tail;
+    unsigned int entries;
+    size_t bytes;
+    // 0 = memory tier disabled
+    size_t maxbytes;
+    // NULL = disk tier disabled
+    char *dir;
+    // statistics
+    double hits;
+    double misses;
+    double evictions;
+    double diskHits;
+    double diskWrites;
+} cache;
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long fnv1a( const void *data, size_t len, unsigned long long hash )
+{
+    const unsigned char *p = (const unsigned char*)data;
+    size_t i;
+    
+    for( i = 0; i < len; i++ ){
+        hash = ( hash ^ p[i] ) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// resize through Resample.cc when the image qualifies
+static int nativeResample = 1;
+
+// raw pixel storage of getPixels/setPixels
+static const struct {
+    const char *name;
+    StorageType type;
+    size_t size;
+} PIXEL_STORAGE[] = {
+    { "uint8", CharPixel, 1 },
+    { "uint16", ShortPixel, 2 },
+    { "float", FloatPixel, sizeof( float ) },
+    { "double", DoublePixel, sizeof( double ) },
+    { NULL, UndefinedPixel, 0 }
+};
+
+// process wide limits accepted by configure()
+static const struct {
+    const char *name;
+    ResourceType type;
+} RESOURCE_LIMITS[] = {
+    { "memory", MemoryResource },
+    { "map", MapResource },
+    { "disk", DiskResource },
+    { "area", AreaResource },
+    { "width", WidthResource },
+    { "height", HeightResource },
+    { "threads", ThreadResource },
+    { NULL, UndefinedResource }
 };
+
+// one output of saveRenditions
+typedef struct {
+    // 0 = keep aspect ratio of the other side
+    unsigned long w;
+    unsigned long h;
+    unsigned int quality;
+    FilterTypes filter;
+    int thumbnail;
+    char *format;
+    // encode to blob if NULL
+    char *path;
+    unsigned char *blob;
+    size_t len;
+} Rendition_t;
+
+// one image of batch()
+typedef struct {
+    // source path or data of a source Buffer
+    char *path;
+    const void *data;
+    size_t len;
+    // encode to blob if NULL
+    char *dst;
+    // 0 = keep aspect ratio of the other side
+    unsigned long w;
+    unsigned long h;
+    // crop to aspect ratio before resize, 0 = no crop
+    double aspect;
+    int align;
+    unsigned int quality;
+    FilterTypes filter;
+    int thumbnail;
+    char *format;
+    // result
+    char *errstr;
+    unsigned char *blob;
+    size_t outlen;
+    unsigned long ow;
+    unsigned long oh;
+} BatchItem_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    BatchItem_t *items;
+    unsigned int nitems;
+    // next item to claim
+    unsigned int next;
+    // indexes of finished items in order of completion
+    unsigned int *finished;
+    unsigned int done;
+    unsigned int failed;
+    // finished items handed over to js
+    unsigned int reported;
+    // progress interval
+    unsigned int every;
+    // running worker batons
+    unsigned int workers;
+    ev_async notifier;
+    // source Buffers by item index, alive until the batch is freed even
+    // if js changes the job list
+    Persistent<Array> sources;
+    Persistent<Function> progress;
+    Persistent<Function> callback;
+} Batch_t;
+
+// identical jobs waiting for a queued or running one
+typedef struct FlightWaiter_s {
+    // job handle id
+    unsigned int id;
+    int cancelled;
+    void *ctx;
+    Persistent<Function> callback;
+    struct FlightWaiter_s *next;
+} FlightWaiter_t;
+
+#define FLIGHT_BUCKETS 1024
+typedef struct Flight_s {
+    unsigned long long key;
+    char *sig;
+    FlightWaiter_t *waiters;
+    struct Flight_s *next;
+} Flight_t;
+
+// in-flight jobs by signature, main thread only
+static Flight_t *flights[FLIGHT_BUCKETS];
+
 typedef struct {
+    // job handle id
+    unsigned int id;
+    // NULL for tasks not bound to an instance
     void *ctx;
     int task;
-    const char *errstr;
+    // malloc'd error message, set by worker thread
+    char *errstr;
     void *udata;
+    // load: source buffer, toBuffer: encoded image owned by ImageMagick
+    Persistent<Object> buffer;
+    unsigned char *blob;
+    size_t len;
+    ProbeInfo_t probe;
+    LoadOpts_t lopts;
+    EncodeOpts_t eopts;
+    JobStats_t stats;
+    Placeholder_t hash;
+    Rendition_t *renditions;
+    unsigned int nrenditions;
+    Batch_t *batch;
+    // leader of coalesced jobs
+    Flight_t *flight;
+    // getPixels/setPixels
+    char pixmap[8];
+    int storage;
+    unsigned long pw;
+    unsigned long ph;
     // callback js function when async is true
     Persistent<Function> callback;
-    Handle<Value> retval;
-    eio_req *req;
+    // worker pool queue
+    int priority;
+    // msec on the monotonic clock
+    double queued;
+    void *next;
+    // set by cancel(), read by worker and progress monitor
+    volatile int cancelled;
+    // cancelled leader of coalesced jobs, runs on for the others
+    int detached;
+    // failed load/setPixels that dropped the previous image
+    int dropped;
+    // absolute msec, 0 = none
+    double deadline;
+    // error code of errstr
+    const char *errcode;
+    // jobs table
+    void *jnext;
 } Baton_t;
 
-static pthread_mutex_t mutex;
+// queued and running jobs by handle id, main thread only
+#define JOB_BUCKETS 1024
+static Baton_t *jobs[JOB_BUCKETS];
+static unsigned int jobseq;
+// job handle class
+static Persistent<FunctionTemplate> jobTemplate;
+
+#define JOB_PRI_MIN -4
+#define JOB_PRI_MAX 4
+#define JOB_PRI_NUM (JOB_PRI_MAX - JOB_PRI_MIN + 1)
+
+// dedicated worker pool for image jobs
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // number of threads wanted and alive
+    unsigned int nthreads;
+    unsigned int alive;
+    unsigned int busy;
+    // extra threads started by running jobs, count against nthreads
+    unsigned int helpers;
+    // queue per priority, highest first
+    Baton_t *head[JOB_PRI_NUM];
+    Baton_t *tail[JOB_PRI_NUM];
+    unsigned int queued;
+    // 0 = unlimited
+    unsigned int maxqueue;
+    // finished jobs handed over to the main thread
+    pthread_mutex_t donelock;
+    Baton_t *donehead;
+    Baton_t *donetail;
+    ev_async notifier;
+    // statistics
+    unsigned int peakqueued;
+    double submitted;
+    double started;
+    double completed;
+    double rejected;
+    double waitsum;
+    double waitmax;
+    // jobs attached to an identical in-flight job
+    double coalesced;
+    // queued jobs dropped by cancel()
+    double cancelled;
+} pool;
 
 // MARK: @interface
 class NodeMagick : public ObjectWrap
@@ -73,24 +550,104 @@ class NodeMagick : public ObjectWrap
     // MARK: @private
     private:
         MagickWand *wand;
+        // serialize operations on the same wand
+        pthread_mutex_t lock;
+        // a worker runs a job of this instance, guarded by pool.lock
+        int claimed;
+        // queued and running async jobs, main thread only
+        unsigned int pending;
         int attached;
         const char *format;
         const char *format_to;
         const char *src;
+        // source buffer of deferred decode
+        Persistent<Object> source;
+        const void *blob;
+        size_t bloblen;
+        int deferred;
+        // loaded with { lazy:true }, decoded with a size hint on save
+        int lazy;
+        // frames of an animation to keep on save, 0 = all
+        unsigned int maxframes;
+        unsigned int framestep;
+        // wand and image interlace replaced by setEncodeOpts
+        InterlaceType interlace;
+        InterlaceType imageInterlace;
+        // estimated pixel memory held by wand, reported to V8
+        double pixmem;
+        double pixmemReported;
+        // stats of running job, guarded by lock
+        JobStats_t jstats;
+        double jstart;
+        // stats of last finished job
+        JobStats_t lastStats;
+        // placeholder of running and last save job
+        Placeholder_t jph;
+        Placeholder_t lastPh;
+        // async job on this wand, read by progress monitor
+        Baton_t * volatile running;
+        // milliseconds allowed to async jobs, 0 = none
+        unsigned int deadline;
+        // hash of source bytes, set when the cache is enabled. a lazy file
+        // is hashed when saveImage decodes it
+        unsigned long long srcHash;
+        int hashed;
+        // identity of source for coalescing jobs, 0 = not known yet
+        unsigned long long srcId;
         unsigned int quality;
-        double scale;
-        int cropped;
-        int resized;
-        long x;
-        long y;
+        FilterTypes filter;
+        int thumbnail;
+        int priority;
+        // raw size and orientation of loaded image
         ImageSize size;
-        ImageSize crop;
-        ImageSize resize;
+        int orientation;
+        // operations to run on save and the size they produce
+        ImageOp_t ops[MAX_OPS];
+        unsigned int nops;
+        ImageSize cur;
         
         // new
         static Handle<Value> New( const Arguments& argv );
-        Handle<Value> loadImage( const char *path );
-        Handle<Value> saveImage( const char *path );
+        // return malloc'd error message or NULL
+        char *loadImage( const char *path, const void *blob, size_t len, LoadOpts_t *opts );
+        char *decodeImage( double *ratio );
+        double decodeRatio( unsigned long w, unsigned long h );
+        char *applyOps( MagickWand *target, double ratio, JobStats_t *js );
+        char *applyFrames( double ratio );
+        static void *frameThread( void *arg );
+        static unsigned int optimizeOps( ImageOp_t *in, unsigned int nin, ImageOp_t *out );
+        ImageOp_t *pushOp( ImageOp_e type );
+        int planResize( unsigned long w, unsigned long h );
+        int planCrop( double aspect, int align );
+        void replayOps( void );
+        static void rotatedSize( double degrees, unsigned long *w, unsigned long *h );
+        ImageSize baseSize( void );
+        static MagickBooleanType orientWand( MagickWand *target );
+        char *renderImages( Rendition_t *list, unsigned int nlist, int placeholder );
+        void makePlaceholder( MagickWand *target );
+        static Local<Value> placeholderToObject( Placeholder_t *ph );
+        static Handle<Value> getPlaceholder( Local<String> prop, const AccessorInfo &info );
+        static int parseRenditions( NodeMagick *ctx, Local<Value> val, Rendition_t **list, unsigned int *nlist );
+        static Local<Array> renditionsToArray( Rendition_t *list, unsigned int nlist );
+        static void freeRenditions( Rendition_t *list, unsigned int nlist );
+        static int parseLoadOpts( Local<Value> val, LoadOpts_t *opts );
+        static int parseEncodeOpts( Local<Value> val, EncodeOpts_t *opts );
+        static char *checkLimits( MagickWand *target, LoadOpts_t *opts );
+        char *saveImage( const char *path, unsigned char **blob, size_t *len, const EncodeOpts_t *eo );
+        MagickBooleanType setEncodeOpts( const EncodeOpts_t *eo );
+        static char *convertToSRGB( MagickWand *target, int keepicc );
+        static int iccToSRGB( MagickWand *target, const unsigned char *icc, size_t icclen );
+        char *fitQuality( const EncodeOpts_t *eo, int multi, unsigned char **blob, size_t *len );
+        static void *probeThread( void *arg );
+        void clearEncodeOpts( const EncodeOpts_t *eo );
+        static char *probeImage( const char *path, const void *blob, size_t len, ProbeInfo_t *info );
+        static Local<Object> probeToObject( ProbeInfo_t *info );
+        static void freeBlob( char *data, void *hint );
+        static int filterByName( const char *name, FilterTypes *filter );
+        static int nativeResize( MagickWand *target, long x, long y, unsigned long w, unsigned long h, 
+                                 unsigned long ow, unsigned long oh, FilterTypes filter, int thumbnail, 
+                                 MagickBooleanType *status );
+        static MagickBooleanType resizeWand( MagickWand *target, unsigned long w, unsigned long h, FilterTypes filter, int thumbnail );
 
         // setter/getter
         static Handle<Value> getFormat( Local<String> prop, const AccessorInfo &info );
@@ -101,35 +658,152 @@ class NodeMagick : public ObjectWrap
         static Handle<Value> getHeight( Local<String> prop, const AccessorInfo &info );
         static Handle<Value> getQuality( Local<String> prop, const AccessorInfo &info );
         static void setQuality( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getFilter( Local<String> prop, const AccessorInfo &info );
+        static void setFilter( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getThumbnail( Local<String> prop, const AccessorInfo &info );
+        static void setThumbnail( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getPriority( Local<String> prop, const AccessorInfo &info );
+        static void setPriority( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getDeadline( Local<String> prop, const AccessorInfo &info );
+        static void setDeadline( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getMaxConcurrency( Local<String> prop, const AccessorInfo &info );
+        static void setMaxConcurrency( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getMaxQueue( Local<String> prop, const AccessorInfo &info );
+        static void setMaxQueue( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> fnPoolStats( const Arguments& argv );
+        static Handle<Value> getMaxPooledWands( Local<String> prop, const AccessorInfo &info );
+        static void setMaxPooledWands( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> fnConfigure( const Arguments& argv );
+        static Handle<Value> fnStats( const Arguments& argv );
+        static Handle<Value> getJobStats( Local<String> prop, const AccessorInfo &info );
         
         static Handle<Value> fnCrop( const Arguments &argv );
         static Handle<Value> fnScale( const Arguments& argv );
         static Handle<Value> fnResize( const Arguments& argv );
         static Handle<Value> fnResizeByWidth( const Arguments& argv );
         static Handle<Value> fnResizeByHeight( const Arguments& argv );
+        static Handle<Value> fnBatch( const Arguments& argv );
+        static Handle<Value> fnRotate( const Arguments& argv );
+        static Handle<Value> fnFlip( const Arguments& argv );
+        static Handle<Value> fnFlop( const Arguments& argv );
+        static Handle<Value> fnAutoOrient( const Arguments& argv );
+        static Handle<Value> fnSharpen( const Arguments& argv );
+        static Handle<Value> fnExtend( const Arguments& argv );
         static Handle<Value> fnLoad( const Arguments& argv );
         static Handle<Value> fnSave( const Arguments& argv );
+        static Handle<Value> fnToBuffer( const Arguments& argv );
+        static Handle<Value> fnSaveRenditions( const Arguments& argv );
+        static Handle<Value> fnDispose( const Arguments& argv );
+        static Handle<Value> fnGetPixels( const Arguments& argv );
+        static Handle<Value> fnSetPixels( const Arguments& argv );
+        static int parsePixelMap( Local<Value> val, char *map, size_t len );
+        static int parsePixelStorage( Local<Value> val, int *storage );
+        static void freePixels( char *data, void *hint );
+        static Local<Object> pixelsInfo( unsigned long w, unsigned long h, const char *map, int storage );
+        char *exportPixels( const char *map, int storage, unsigned char **data, size_t *len, unsigned long *w, unsigned long *h );
+        char *importPixels( const void *data, size_t len, unsigned long w, unsigned long h, const char *map, int storage );
+        static Handle<Value> fnProbe( const Arguments& argv );
         
         // thread task
-        static int beginEIO( eio_req *req );
-        static int endEIO( eio_req *req );
+        static MagickWand *acquireWand( void );
+        static void releaseWand( MagickWand *target );
+        void trackMemory( void );
+        void reportMemory( void );
+        static void adjustExternal( double delta );
+        void disposeImage( void );
+        void disposeWand( void );
+        void beginStats( void );
+        void endStats( int failed );
+        static void recordJob( JobStats_t *js, int failed );
+        void notePeak( double bytes );
+        static double wandBytes( MagickWand *target );
+        static void recordPhase( int phase, double msec );
+        static Local<Object> jobStatsToObject( JobStats_t *js );
+        static void setPoolThreads( unsigned int nthreads );
+        static void *workerThread( void *arg );
+        static Baton_t *takeJob( void );
+        static unsigned int acquireHelpers( unsigned int want );
+        static void releaseHelpers( unsigned int n );
+        static void onJobDone( EV_P_ ev_async *watcher, int revents );
+        static Baton_t *newBaton( NodeMagick *ctx, int task, Local<Value> callback );
+        static void freeBaton( Baton_t *baton );
+        static Handle<Value> queueBaton( Baton_t *baton );
+        static void runJob( Baton_t *baton );
+        static void endJob( Baton_t *baton );
+        // cancellation
+        static Local<Object> jobHandle( unsigned int id );
+        static Local<Value> jobError( const char *msg, const char *code );
+        static int cancelJob( unsigned int id );
+        static Handle<Value> fnCancel( const Arguments& argv );
+        static MagickBooleanType progressMonitor( const char *text, const MagickOffsetType offset, 
+                                                  const MagickSizeType span, void *client );
+        void armMonitor( MagickWand *target );
+        // single-flight
+        Handle<Value> queueFlight( int task, const char *path, const EncodeOpts_t *eo, 
+                                   Local<Value> callback );
+        static Flight_t *findFlight( const char *sig, unsigned long long key );
+        static void removeFlight( Flight_t *flight );
+        // batch
+        static int parseBatch( Local<Value> val, Batch_t *batch );
+        static void freeBatch( Batch_t *batch );
+        static void runBatch( Batch_t *batch );
+        static char *batchItem( BatchItem_t *item, JobStats_t *js );
+        static Local<Object> batchItemToObject( BatchItem_t *item, unsigned int idx );
+        static void flushBatch( Batch_t *batch, int final );
+        static void onBatchProgress( EV_P_ ev_async *watcher, int revents );
+        // cache
+        static int fileIdentity( const char *path, unsigned long long *id );
+        static void *mapFile( const char *path, size_t *len );
+        static unsigned char *readFile( const char *path, size_t *len );
+        int jobSignature( const char *target, unsigned long long id, const EncodeOpts_t *eo, 
+                          char *sig, size_t len );
+        static unsigned char *cacheGet( const char *sig, size_t *len );
+        static void cachePut( const char *sig, const unsigned char *data, size_t len );
+        static void cacheInsert( const char *sig, unsigned long long key, const unsigned char *data, size_t len );
+        static void cacheEvict( size_t maxbytes );
+        static int writeFile( const char *path, const char *head, size_t hlen, const unsigned char *data, size_t len );
+        static Handle<Value> fnCache( const Arguments& argv );
+        static Handle<Value> getResampler( Local<String> prop, const AccessorInfo &info );
+        static void setResampler( Local<String> prop, Local<Value> val, const AccessorInfo &info );
 };
 
 // MARK: @implements
 NodeMagick::NodeMagick()
 {
-    wand = NewMagickWand();
+    wand = acquireWand();
+    pthread_mutex_init( &lock, NULL );
+    claimed = 0;
+    pending = 0;
     attached = 0;
     format = NULL;
     format_to = NULL;
     src = NULL;
+    blob = NULL;
+    bloblen = 0;
+    deferred = 0;
+    lazy = 0;
+    maxframes = framestep = 0;
+    interlace = imageInterlace = UndefinedInterlace;
+    pixmem = pixmemReported = 0;
+    memset( &jstats, 0, sizeof( JobStats_t ) );
+    memset( &lastStats, 0, sizeof( JobStats_t ) );
+    memset( &jph, 0, sizeof( Placeholder_t ) );
+    memset( &lastPh, 0, sizeof( Placeholder_t ) );
+    jstart = 0;
+    srcHash = 0;
+    hashed = 0;
+    srcId = 0;
+    running = NULL;
+    deadline = 0;
     quality = 100;
-    scale = 100.0;
-    cropped = resized = 0;
-    x = y = 0;
-    size.w = crop.w = resize.w = 0;
-    size.h = crop.h = resize.h = 0;
-    size.aspect = crop.aspect = 1;
+    filter = UndefinedFilter;
+    thumbnail = 0;
+    priority = 0;
+    orientation = UndefinedOrientation;
+    nops = 0;
+    size.w = cur.w = 0;
+    size.h = cur.h = 0;
+    size.aspect = cur.aspect = 1;
 }
 
 NodeMagick::~NodeMagick()
@@ -137,313 +811,4850 @@ NodeMagick::~NodeMagick()
     if( src ){
         free( (void*)src );
     }
+    if( !source.IsEmpty() ){
+        source.Dispose();
+    }
     if( format_to ){
         free( (void*)format_to );
     }
     if( wand ){
-        DestroyMagickWand(wand);
+        releaseWand( wand );
+    }
+    if( format ){
+        MagickRelinquishMemory( (void*)format );
     }
+    if( pixmemReported ){
+        adjustExternal( -pixmemReported );
+    }
+    pthread_mutex_destroy( &lock );
 }
 
+// V8 takes an int, report larger amounts in chunks
+void NodeMagick::adjustExternal( double delta )
+{
+    while( delta >= 1 || delta <= -1 )
+    {
+        int chunk = ( delta > INT_MAX ) ? INT_MAX : 
+                    ( delta < -INT_MAX ) ? -INT_MAX : (int)delta;
+        
+        V8::AdjustAmountOfExternalAllocatedMemory( chunk );
+        delta -= chunk;
+    }
+}
 
-int NodeMagick::beginEIO( eio_req *req )
+MagickWand *NodeMagick::acquireWand( void )
 {
-    Baton_t *baton = static_cast<Baton_t*>( req->data );
-    NodeMagick *ctx = (NodeMagick*)baton->ctx;
+    MagickWand *target = NULL;
     
-    // failed to lock mutex
-    if( pthread_mutex_lock( &mutex ) ){
-        baton->errstr = strerror(errno);
+    pthread_mutex_lock( &wandpool.lock );
+    if( wandpool.count ){
+        target = wandpool.wands[--wandpool.count];
     }
-    else
+    pthread_mutex_unlock( &wandpool.lock );
+    
+    return ( target ) ? target : NewMagickWand();
+}
+
+void NodeMagick::releaseWand( MagickWand *target )
+{
+    ClearMagickWand( target );
+    pthread_mutex_lock( &wandpool.lock );
+    if( wandpool.count < wandpool.max ){
+        wandpool.wands[wandpool.count++] = target;
+        target = NULL;
+    }
+    pthread_mutex_unlock( &wandpool.lock );
+    
+    if( target ){
+        DestroyMagickWand( target );
+    }
+}
+
+// call with lock held
+void NodeMagick::trackMemory( void )
+{
+    if( !wand || !attached || deferred ){
+        pixmem = 0;
+    }
+    else {
+        pixmem = (double)MagickGetImageWidth( wand ) * 
+                 (double)MagickGetImageHeight( wand ) * 
+                 (double)MagickGetNumberImages( wand ) * 
+                 (double)wandpool.pixelsize;
+    }
+}
+
+// call from main thread
+void NodeMagick::reportMemory( void )
+{
+    double delta = pixmem - pixmemReported;
+    
+    if( delta ){
+        adjustExternal( delta );
+        pixmemReported = pixmem;
+    }
+}
+
+// call with lock held
+void NodeMagick::disposeImage( void )
+{
+    attached = 0;
+    deferred = 0;
+    blob = NULL;
+    bloblen = 0;
+    if( src ){
+        free( (void*)src );
+        src = NULL;
+    }
+    if( format ){
+        MagickRelinquishMemory( (void*)format );
+        format = NULL;
+    }
+}
+
+// call with lock held: give the wand back to the pool
+void NodeMagick::disposeWand( void )
+{
+    if( wand ){
+        releaseWand( wand );
+        wand = NULL;
+    }
+    disposeImage();
+    trackMemory();
+}
+
+
+// monotonic, a clock step must not shift phase times or deadlines
+static double nowMsec( void )
+{
+    struct timespec now;
+    
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static double fileSize( const char *path )
+{
+    struct stat info;
+    return ( stat( path, &info ) == 0 ) ? (double)info.st_size : 0;
+}
+
+double NodeMagick::wandBytes( MagickWand *target )
+{
+    if( !target || !MagickGetNumberImages( target ) ){
+        return 0;
+    }
+    return (double)MagickGetImageWidth( target ) * 
+           (double)MagickGetImageHeight( target ) * 
+           (double)MagickGetNumberImages( target ) * 
+           (double)wandpool.pixelsize;
+}
+
+void NodeMagick::recordPhase( int phase, double msec )
+{
+    int i = 0;
+    
+    // caller holds stats.lock
+    if( msec >= 1 ){
+        i = (int)log2( msec ) + 1;
+        i = ( i < STATS_BUCKETS ) ? i : STATS_BUCKETS - 1;
+    }
+    stats.phase[phase].count++;
+    stats.phase[phase].sum += msec;
+    stats.phase[phase].hist[i]++;
+    if( msec > stats.phase[phase].max ){
+        stats.phase[phase].max = msec;
+    }
+}
+
+// call with lock held
+void NodeMagick::beginStats( void )
+{
+    memset( &jstats, 0, sizeof( JobStats_t ) );
+    jph.valid = 0;
+    jstart = nowMsec();
+}
+
+// call with lock held
+void NodeMagick::endStats( int failed )
+{
+    jstats.msec[PHASE_TOTAL] = nowMsec() - jstart;
+    recordJob( &jstats, failed );
+}
+void NodeMagick::recordJob( JobStats_t *js, int failed )
+{
+    int i;
+    
+    pthread_mutex_lock( &stats.lock );
+    stats.jobs++;
+    stats.errors += ( failed ) ? 1 : 0;
+    stats.bytesIn += js->bytesIn;
+    stats.bytesOut += js->bytesOut;
+    // queue wait is recorded by worker thread
+    for( i = PHASE_DECODE; i < PHASE_NUM; i++ )
     {
-        if( baton->task & ASYNC_TASK_LOAD ){
-            baton->retval = ctx->loadImage( (const char*)baton->udata );
+        if( js->msec[i] > 0 || i == PHASE_TOTAL ){
+            recordPhase( i, js->msec[i] );
+        }
+    }
+    pthread_mutex_unlock( &stats.lock );
+}
+
+void NodeMagick::notePeak( double bytes )
+{
+    if( bytes > jstats.peakPixels ){
+        jstats.peakPixels = bytes;
+    }
+}
+
+// 0 = number of cpus
+void NodeMagick::setPoolThreads( unsigned int nthreads )
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    
+    if( !nthreads ){
+        long ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+        nthreads = ( ncpu > 0 ) ? ncpu : 1;
+    }
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    
+    pthread_mutex_lock( &pool.lock );
+    pool.nthreads = nthreads;
+    while( pool.alive < pool.nthreads && 
+           pthread_create( &tid, &attr, workerThread, NULL ) == 0 ){
+        pool.alive++;
+    }
+    // extra threads exit when they wake up
+    pthread_cond_broadcast( &pool.cond );
+    pthread_mutex_unlock( &pool.lock );
+    
+    pthread_attr_destroy( &attr );
+}
+
+// call with pool.lock held: unlink the oldest job of the highest
+// priority whose instance is not being worked on. jobs of a busy
+// instance stay queued instead of blocking a thread on its lock.
+Baton_t *NodeMagick::takeJob( void )
+{
+    Baton_t *baton, *prev;
+    int i;
+    
+    // helper threads of running jobs use the rest
+    if( pool.busy + pool.helpers >= pool.nthreads ){
+        return NULL;
+    }
+    for( i = JOB_PRI_NUM - 1; i >= 0; i-- )
+    {
+        for( prev = NULL, baton = pool.head[i]; baton; prev = baton, baton = (Baton_t*)baton->next )
+        {
+            NodeMagick *ctx = (NodeMagick*)baton->ctx;
+            
+            if( ctx && ctx->claimed ){
+                continue;
+            }
+            if( prev ){
+                prev->next = baton->next;
+            }
+            else {
+                pool.head[i] = (Baton_t*)baton->next;
+            }
+            if( pool.tail[i] == baton ){
+                pool.tail[i] = prev;
+            }
+            if( ctx ){
+                ctx->claimed = 1;
+            }
+            pool.queued--;
+            return baton;
+        }
+    }
+    
+    return NULL;
+}
+
+// threads a job may start in addition to its own without running more
+// than maxConcurrency threads in total, at most want
+unsigned int NodeMagick::acquireHelpers( unsigned int want )
+{
+    unsigned int n = 0;
+    
+    pthread_mutex_lock( &pool.lock );
+    if( pool.busy + pool.helpers < pool.nthreads ){
+        n = pool.nthreads - pool.busy - pool.helpers;
+        n = ( n < want ) ? n : want;
+        pool.helpers += n;
+    }
+    pthread_mutex_unlock( &pool.lock );
+    
+    return n;
+}
+
+void NodeMagick::releaseHelpers( unsigned int n )
+{
+    if( n ){
+        pthread_mutex_lock( &pool.lock );
+        pool.helpers -= n;
+        // queued jobs may start now
+        pthread_cond_broadcast( &pool.cond );
+        pthread_mutex_unlock( &pool.lock );
+    }
+}
+
+void *NodeMagick::workerThread( void * )
+{
+    Baton_t *baton = NULL;
+    NodeMagick *ctx;
+    double wait;
+    
+    pthread_mutex_lock( &pool.lock );
+    while( 1 )
+    {
+        while( pool.alive <= pool.nthreads && !( baton = takeJob() ) ){
+            pthread_cond_wait( &pool.cond, &pool.lock );
+        }
+        // pool shrunk
+        if( !baton ){
+            pool.alive--;
+            break;
+        }
+        
+        ctx = (NodeMagick*)baton->ctx;
+        pool.busy++;
+        pool.started++;
+        wait = nowMsec() - baton->queued;
+        pool.waitsum += wait;
+        if( wait > pool.waitmax ){
+            pool.waitmax = wait;
         }
-        else if( baton->task & ASYNC_TASK_SAVE ){
-            baton->retval = ctx->saveImage( (const char*)baton->udata );
+        pthread_mutex_unlock( &pool.lock );
+        
+        pthread_mutex_lock( &stats.lock );
+        recordPhase( PHASE_QUEUE, wait );
+        pthread_mutex_unlock( &stats.lock );
+        
+        runJob( baton );
+        baton->stats.msec[PHASE_QUEUE] = wait;
+        
+        // release the instance before the main thread may free it,
+        // its next job can run on another thread
+        pthread_mutex_lock( &pool.lock );
+        if( ctx ){
+            ctx->claimed = 0;
+            pthread_cond_signal( &pool.cond );
         }
+        pool.busy--;
+        pool.completed++;
+        pthread_mutex_unlock( &pool.lock );
         
-        // failed to unlock mutex
-        if( pthread_mutex_unlock( &mutex ) ){
-            baton->errstr = strerror(errno);
+        // hand over to main thread
+        baton->next = NULL;
+        pthread_mutex_lock( &pool.donelock );
+        if( pool.donetail ){
+            pool.donetail->next = baton;
         }
+        else {
+            pool.donehead = baton;
+        }
+        pool.donetail = baton;
+        pthread_mutex_unlock( &pool.donelock );
+        ev_async_send( EV_DEFAULT_UC, &pool.notifier );
+        
+        baton = NULL;
+        pthread_mutex_lock( &pool.lock );
     }
+    pthread_mutex_unlock( &pool.lock );
     
-    return 0;
+    return NULL;
 }
 
-int NodeMagick::endEIO( eio_req *req )
+void NodeMagick::onJobDone( EV_P_ ev_async *, int )
 {
-    HandleScope scope;
-    Baton_t *baton = static_cast<Baton_t*>(req->data);
-    NodeMagick *ctx = (NodeMagick*)baton->ctx;
-    int task = baton->task;
-    Local<Function> cb = Local<Function>::New( baton->callback );
-    Handle<Primitive> t = Undefined();
-    Local<Value> errstr = reinterpret_cast<Local<Value>&>(t);
-    Local<Value> argv[] = {
-        reinterpret_cast<Local<Value>&>(errstr)
-    };
+    Baton_t *baton;
+    
+    pthread_mutex_lock( &pool.donelock );
+    baton = pool.donehead;
+    pool.donehead = pool.donetail = NULL;
+    pthread_mutex_unlock( &pool.donelock );
+    
+    while( baton )
+    {
+        Baton_t *next = (Baton_t*)baton->next;
+        endJob( baton );
+        baton = next;
+    }
+}
 
-    ev_unref(EV_DEFAULT_UC);
-    ctx->Unref();
+Baton_t *NodeMagick::newBaton( NodeMagick *ctx, int task, Local<Value> callback )
+{
+    Baton_t *baton = new Baton_t();
     
-    if( baton->errstr ){
-        errstr = Exception::Error( String::New( baton->errstr ) );
+    baton->task = task;
+    baton->ctx = (void*)ctx;
+    baton->errstr = NULL;
+    baton->udata = NULL;
+    baton->blob = NULL;
+    baton->len = 0;
+    memset( &baton->probe, 0, sizeof( ProbeInfo_t ) );
+    memset( &baton->lopts, 0, sizeof( LoadOpts_t ) );
+    baton->renditions = NULL;
+    baton->nrenditions = 0;
+    baton->batch = NULL;
+    baton->flight = NULL;
+    baton->pixmap[0] = 0;
+    baton->storage = 0;
+    baton->pw = baton->ph = 0;
+    baton->id = ( ++jobseq ) ? jobseq : ++jobseq;
+    baton->cancelled = 0;
+    baton->detached = 0;
+    baton->dropped = 0;
+    baton->deadline = ( ctx && ctx->deadline ) ? nowMsec() + ctx->deadline : 0;
+    baton->errcode = NULL;
+    baton->jnext = NULL;
+    baton->priority = ( ctx ) ? ctx->priority : 0;
+    baton->next = NULL;
+    // detouch from GC
+    baton->callback = Persistent<Function>::New( Local<Function>::Cast( callback ) );
+    
+    return baton;
+}
+
+void NodeMagick::freeBaton( Baton_t *baton )
+{
+    if( baton->renditions ){
+        freeRenditions( baton->renditions, baton->nrenditions );
     }
-    else if( IsDefined( baton->retval ) ){
-        errstr = Exception::Error( baton->retval->ToString() );
+    if( baton->probe.format ){
+        MagickRelinquishMemory( baton->probe.format );
     }
-    
-    // cleanup
     baton->callback.Dispose();
+    if( !baton->buffer.IsEmpty() ){
+        baton->buffer.Dispose();
+    }
     if( baton->udata ){
         free((void*)baton->udata);
     }
     delete baton;
-    
-    TryCatch try_catch;
-    // call js function by callback function context
-    // !!!: which is better callback or Context::GetCurrent()->Global() context
-    cb->Call( ctx->handle_, 1, argv );
-    if( try_catch.HasCaught() ){
-        FatalException(try_catch);
-    }
-    
-    eio_cancel(req);
-    
-    return 0;
 }
 
-Handle<Value> NodeMagick::New( const Arguments& argv )
+Handle<Value> NodeMagick::queueBaton( Baton_t *baton )
 {
-    HandleScope scope;
-    NodeMagick *ctx = new NodeMagick();
-    Handle<Value> retval = Undefined();
+    int i = baton->priority - JOB_PRI_MIN;
     
-    if( !ctx->wand ){
-        delete ctx;
-        retval = ThrowException( Exception::Error( String::New(strerror(ENOMEM)) ) );
+    pthread_mutex_lock( &pool.lock );
+    // backpressure, a dispose must not fail
+    if( pool.maxqueue && pool.queued >= pool.maxqueue && !( baton->task & ASYNC_TASK_DISPOSE ) )
+    {
+        Local<Value> err = Exception::Error( String::New( "job queue is full" ) );
+        
+        pool.rejected++;
+        pthread_mutex_unlock( &pool.lock );
+        // nobody joined yet
+        if( baton->flight ){
+            removeFlight( baton->flight );
+            free( baton->flight->sig );
+            free( baton->flight );
+        }
+        freeBaton( baton );
+        err->ToObject()->Set( String::NewSymbol("code"), String::NewSymbol("EAGAIN") );
+        
+        return ThrowException( err );
+    }
+    
+    baton->queued = nowMsec();
+    if( pool.tail[i] ){
+        pool.tail[i]->next = baton;
     }
     else {
-        ctx->Wrap( argv.This() );
-        retval = argv.This();
+        pool.head[i] = baton;
     }
+    pool.tail[i] = baton;
+    pool.submitted++;
+    if( ++pool.queued > pool.peakqueued ){
+        pool.peakqueued = pool.queued;
+    }
+    pthread_cond_signal( &pool.cond );
+    pthread_mutex_unlock( &pool.lock );
     
-    return scope.Close( retval );
+    if( baton->ctx ){
+        ((NodeMagick*)baton->ctx)->Ref();
+        ((NodeMagick*)baton->ctx)->pending++;
+    }
+    ev_ref(EV_DEFAULT_UC);
+    baton->jnext = jobs[baton->id % JOB_BUCKETS];
+    jobs[baton->id % JOB_BUCKETS] = baton;
+    
+    return jobHandle( baton->id );
 }
 
-
-Handle<Value> NodeMagick::loadImage( const char *path )
+void NodeMagick::runJob( Baton_t *baton )
 {
-    Handle<Value> retval = Undefined();
-    MagickBooleanType status;
+    NodeMagick *ctx = (NodeMagick*)baton->ctx;
     
-    if( attached ){
-        wand = DestroyMagickWand( wand );
-        wand = NewMagickWand();
-        attached = 0;
-        free( (void*)src );
+    // too late to start
+    if( baton->cancelled ){
+        baton->errstr = strdup( "job cancelled" );
+        baton->errcode = "ECANCELED";
     }
-    if( ( status = MagickReadImage( wand, path ) ) == MagickFalse ){
-        WandStrError(wand,retval);
+    else if( baton->deadline && nowMsec() > baton->deadline ){
+        baton->errstr = strdup( "deadline exceeded" );
+        baton->errcode = "ETIMEDOUT";
     }
-    else {
-        attached = 1;
-        src = strdup(path);
-        format = MagickGetImageFormat( wand );
-        size.w = crop.w = resize.w = MagickGetImageWidth( wand );
-        size.h = crop.h = resize.h = MagickGetImageHeight( wand );
-        size.aspect = crop.aspect = (double)size.w/(double)size.h;
+    else if( baton->task & ASYNC_TASK_DISPOSE ){
+        pthread_mutex_lock( &ctx->lock );
+        ctx->disposeWand();
+        pthread_mutex_unlock( &ctx->lock );
+    }
+    // does not touch any instance
+    else if( baton->task & ASYNC_TASK_PROBE ){
+        baton->errstr = probeImage( (const char*)baton->udata, baton->blob, baton->len, &baton->probe );
     }
+    else if( baton->task & ASYNC_TASK_BATCH ){
+        runBatch( baton->batch );
+    }
+    // failed to lock mutex
+    else if( ( errno = pthread_mutex_lock( &ctx->lock ) ) ){
+        baton->errstr = strdup( strerror(errno) );
+    }
+    else
+    {
+        ctx->running = baton;
+        if( ctx->wand ){
+            ctx->armMonitor( ctx->wand );
+        }
+        ctx->beginStats();
+        if( baton->task & ASYNC_TASK_LOAD ){
+            baton->errstr = ctx->loadImage( (const char*)baton->udata, baton->blob, baton->len, &baton->lopts );
+        }
+        else if( baton->task & ( ASYNC_TASK_SAVE|ASYNC_TASK_TOBUFFER ) )
+        {
+            // identity of a lazy buffer for coalescing later jobs, hashed
+            // here and not on the loop. the bytes of an eager load are
+            // gone, its jobs are not coalesced
+            if( ctx->attached && !ctx->srcId && ctx->blob ){
+                ctx->srcId = fnv1a( ctx->blob, ctx->bloblen, FNV_OFFSET );
+            }
+            if( baton->task & ASYNC_TASK_SAVE ){
+                baton->errstr = ctx->saveImage( (const char*)baton->udata, NULL, NULL, &baton->eopts );
+            }
+            else {
+                baton->errstr = ctx->saveImage( NULL, &baton->blob, &baton->len, &baton->eopts );
+            }
+        }
+        else if( baton->task & ASYNC_TASK_RENDITIONS ){
+            baton->errstr = ctx->renderImages( baton->renditions, baton->nrenditions, 
+                                               baton->eopts.placeholder );
+        }
+        else if( baton->task & ASYNC_TASK_GETPIXELS ){
+            baton->errstr = ctx->exportPixels( baton->pixmap, baton->storage, &baton->blob, 
+                                               &baton->len, &baton->pw, &baton->ph );
+        }
+        else if( baton->task & ASYNC_TASK_SETPIXELS ){
+            baton->errstr = ctx->importPixels( baton->blob, baton->len, baton->pw, baton->ph, 
+                                               baton->pixmap, baton->storage );
+        }
+        ctx->running = NULL;
+        if( ( baton->task & ( ASYNC_TASK_LOAD|ASYNC_TASK_SETPIXELS ) ) && baton->errstr ){
+            baton->dropped = !ctx->attached;
+        }
+        // aborted by progress monitor
+        if( baton->errstr && baton->cancelled ){
+            free( baton->errstr );
+            baton->errstr = strdup( "job cancelled" );
+            baton->errcode = "ECANCELED";
+        }
+        else if( baton->errstr && baton->deadline && nowMsec() > baton->deadline ){
+            free( baton->errstr );
+            baton->errstr = strdup( "deadline exceeded" );
+            baton->errcode = "ETIMEDOUT";
+        }
+        ctx->endStats( baton->errstr != NULL );
+        baton->stats = ctx->jstats;
+        baton->hash = ctx->jph;
+        ctx->trackMemory();
+        pthread_mutex_unlock( &ctx->lock );
+    }
+}
+
+void NodeMagick::endJob( Baton_t *baton )
+{
+    HandleScope scope;
+    NodeMagick *ctx = (NodeMagick*)baton->ctx;
+    Local<Function> cb = Local<Function>::New( baton->callback );
+    Handle<Primitive> t = Undefined();
+    Local<Value> argv[] = {
+        reinterpret_cast<Local<Value>&>(t),
+        reinterpret_cast<Local<Value>&>(t),
+        reinterpret_cast<Local<Value>&>(t)
+    };
+    int argc = 1;
+    char *errstr = baton->errstr;
+    Flight_t *flight = baton->flight;
+    int task = baton->task;
+    int succeeded;
+    Placeholder_t ph = baton->hash;
+
+    ev_unref(EV_DEFAULT_UC);
+    // drop from jobs table
+    {
+        Baton_t **ptr = &jobs[baton->id % JOB_BUCKETS];
+        
+        while( *ptr && *ptr != baton ){
+            ptr = (Baton_t**)&(*ptr)->jnext;
+        }
+        if( *ptr ){
+            *ptr = (Baton_t*)baton->jnext;
+        }
+    }
+    // batch calls back when its last worker is done
+    if( baton->task & ASYNC_TASK_BATCH )
+    {
+        Batch_t *batch = baton->batch;
+        
+        freeBaton( baton );
+        if( --batch->workers == 0 ){
+            flushBatch( batch, 1 );
+        }
+        return;
+    }
+    else if( baton->task & ASYNC_TASK_DISPOSE )
+    {
+        freeBaton( baton );
+        ctx->reportMemory();
+        if( !ctx->source.IsEmpty() ){
+            ctx->source.Dispose();
+            ctx->source.Clear();
+        }
+        ctx->pending--;
+        ctx->Unref();
+        return;
+    }
+    else if( ctx ){
+        if( !( baton->task & ASYNC_TASK_PROBE ) && !baton->cancelled ){
+            ctx->lastStats = baton->stats;
+        }
+        if( ( baton->task & ( ASYNC_TASK_SAVE|ASYNC_TASK_TOBUFFER|ASYNC_TASK_RENDITIONS ) ) && 
+            !baton->cancelled ){
+            ctx->lastPh = baton->hash;
+        }
+        ctx->reportMemory();
+        ctx->pending--;
+        ctx->Unref();
+    }
+    
+    // cancelled after the worker passed its last check, or in code that
+    // does not call the progress monitor: cancel() promised ECANCELED, so
+    // the result is dropped. what the job did (a written file, a loaded
+    // image) stays.
+    succeeded = ( errstr == NULL );
+    if( baton->cancelled && !errstr )
+    {
+        errstr = strdup( "job cancelled" );
+        baton->errcode = "ECANCELED";
+        if( baton->task & ASYNC_TASK_TOBUFFER ){
+            MagickRelinquishMemory( baton->blob );
+            baton->blob = NULL;
+        }
+        else if( baton->task & ASYNC_TASK_GETPIXELS ){
+            free( baton->blob );
+            baton->blob = NULL;
+        }
+    }
+    
+    if( errstr ){
+        argv[0] = jobError( errstr, baton->errcode );
+    }
+    else if( baton->task & ASYNC_TASK_SAVE ){
+        if( ph.valid ){
+            argv[1] = placeholderToObject( &ph );
+            argc = 2;
+        }
+    }
+    else if( baton->task & ASYNC_TASK_TOBUFFER ){
+        // hand over encoded image to js without copy
+        argv[1] = Local<Object>::New( Buffer::New( (char*)baton->blob, baton->len, freeBlob, NULL )->handle_ );
+        argc = 2;
+        if( ph.valid ){
+            argv[2] = placeholderToObject( &ph );
+            argc = 3;
+        }
+    }
+    else if( baton->task & ASYNC_TASK_PROBE ){
+        argv[1] = probeToObject( &baton->probe );
+        argc = 2;
+    }
+    else if( baton->task & ASYNC_TASK_RENDITIONS ){
+        argv[1] = renditionsToArray( baton->renditions, baton->nrenditions );
+        argc = 2;
+        if( ph.valid ){
+            argv[2] = placeholderToObject( &ph );
+            argc = 3;
+        }
+    }
+    else if( baton->task & ASYNC_TASK_GETPIXELS ){
+        // hand over pixels to js without copy
+        argv[1] = Local<Object>::New( Buffer::New( (char*)baton->blob, baton->len, freePixels, NULL )->handle_ );
+        argv[2] = pixelsInfo( baton->pw, baton->ph, baton->pixmap, baton->storage );
+        argc = 3;
+    }
+    // deferred decode reads the source buffer at save time, a failed load
+    // that dropped the previous image releases its buffer too
+    if( ( baton->task & ( ASYNC_TASK_LOAD|ASYNC_TASK_SETPIXELS ) ) && ( succeeded || baton->dropped ) )
+    {
+        if( !ctx->source.IsEmpty() ){
+            ctx->source.Dispose();
+            ctx->source.Clear();
+        }
+        if( succeeded && baton->lopts.lazy && !baton->buffer.IsEmpty() ){
+            ctx->source = baton->buffer;
+            baton->buffer.Clear();
+        }
+    }
+    // later identical jobs attach to a new flight
+    if( flight ){
+        removeFlight( flight );
+    }
+    
+    const char *errcode = baton->errcode;
+    int detached = baton->detached;
+    
+    // cleanup
+    freeBaton( baton );
+    
+    TryCatch try_catch;
+    // call js function by callback function context
+    // !!!: which is better callback or Context::GetCurrent()->Global() context
+    if( detached ){
+        Local<Value> cargv[] = { jobError( "job cancelled", "ECANCELED" ) };
+        cb->Call( ctx->handle_, 1, cargv );
+    }
+    else {
+        cb->Call( ( ctx ) ? Handle<Object>( ctx->handle_ ) : 
+                            Handle<Object>( Context::GetCurrent()->Global() ), argc, argv );
+    }
+    if( try_catch.HasCaught() ){
+        FatalException(try_catch);
+    }
+    
+    // coalesced jobs get the same result, each with its own buffer
+    while( flight && flight->waiters )
+    {
+        FlightWaiter_t *waiter = flight->waiters;
+        NodeMagick *wctx = (NodeMagick*)waiter->ctx;
+        Local<Function> wcb = Local<Function>::New( waiter->callback );
+        Local<Value> wargv[] = { argv[0], argv[1], argv[2] };
+        int wargc = argc;
+        
+        flight->waiters = waiter->next;
+        if( waiter->cancelled ){
+            wargv[0] = jobError( "job cancelled", "ECANCELED" );
+            wargc = 1;
+        }
+        else if( !errstr && argc > 1 && Buffer::HasInstance( argv[1] ) ){
+            Local<Object> src = argv[1]->ToObject();
+            wargv[1] = Local<Object>::New( Buffer::New( Buffer::Data( src ), Buffer::Length( src ) )->handle_ );
+            if( ph.valid ){
+                wargv[2] = placeholderToObject( &ph );
+            }
+        }
+        else if( !errstr && ph.valid && ( task & ASYNC_TASK_SAVE ) ){
+            wargv[1] = placeholderToObject( &ph );
+        }
+        else if( errstr ){
+            wargv[0] = jobError( errstr, errcode );
+        }
+        waiter->callback.Dispose();
+        delete waiter;
+        wctx->Unref();
+        
+        TryCatch try_catch;
+        wcb->Call( wctx->handle_, wargc, wargv );
+        if( try_catch.HasCaught() ){
+            FatalException(try_catch);
+        }
+    }
+    if( flight ){
+        free( flight->sig );
+        free( flight );
+    }
+    if( errstr ){
+        free( errstr );
+    }
+}
+
+// queue a save/toBuffer job, or attach to an identical one that is
+// queued or running. identical means same source, load mode, operations
+// and encoder settings. a waiter only gets the leader's result passed
+// to its callback: its own wand is not transformed, and its jobStats and
+// placeholder stay as they were.
+Handle<Value> NodeMagick::queueFlight( int task, const char *path, const EncodeOpts_t *eo, 
+                                       Local<Value> callback )
+{
+    char sig[4096];
+    unsigned long long key = 0;
+    Flight_t *flight = NULL;
+    Baton_t *baton;
+    
+    // the image state read here is only current while no job of this
+    // instance is queued or running, otherwise the job runs alone. only
+    // jobs of a loaded image have a stable identity, a lazy buffer gets
+    // one from its first save on the worker. a job with a deadline runs
+    // alone: a waiter would inherit the leader's timeout or outlive its own.
+    // the placeholder is part of the result handed to waiters but not of
+    // the encoded bytes, so it keys the flight and not the cache
+    if( !pending && !eo->deadline && !deadline && attached && srcId && 
+        jobSignature( ( path ) ? path : "", srcId, eo, sig, sizeof( sig ) ) == 0 && 
+        strlen( sig ) + 4 < sizeof( sig ) )
+    {
+        strcat( sig, ( eo->placeholder ) ? "|p:1" : "|p:0" );
+        key = fnv1a( sig, strlen( sig ), ( task & ASYNC_TASK_SAVE ) ? FNV_OFFSET : ~FNV_OFFSET );
+        if( ( flight = findFlight( sig, key ) ) )
+        {
+            FlightWaiter_t *waiter = new FlightWaiter_t();
+            
+            waiter->id = ( ++jobseq ) ? jobseq : ++jobseq;
+            waiter->cancelled = 0;
+            waiter->ctx = (void*)this;
+            waiter->callback = Persistent<Function>::New( Local<Function>::Cast( callback ) );
+            waiter->next = flight->waiters;
+            flight->waiters = waiter;
+            pool.coalesced++;
+            Ref();
+            return jobHandle( waiter->id );
+        }
+        else if( ( flight = (Flight_t*)calloc( 1, sizeof( Flight_t ) ) ) && 
+                 !( flight->sig = strdup( sig ) ) ){
+            free( flight );
+            flight = NULL;
+        }
+    }
+    
+    baton = newBaton( this, task, callback );
+    if( path ){
+        baton->udata = strdup( path );
+    }
+    baton->eopts = *eo;
+    if( eo->deadline ){
+        baton->deadline = nowMsec() + eo->deadline;
+    }
+    if( flight ){
+        flight->key = key;
+        flight->next = flights[key % FLIGHT_BUCKETS];
+        flights[key % FLIGHT_BUCKETS] = flight;
+        baton->flight = flight;
+    }
+    
+    return queueBaton( baton );
+}
+
+Flight_t *NodeMagick::findFlight( const char *sig, unsigned long long key )
+{
+    Flight_t *flight = flights[key % FLIGHT_BUCKETS];
+    
+    while( flight && ( flight->key != key || strcmp( flight->sig, sig ) != 0 ) ){
+        flight = flight->next;
+    }
+    
+    return flight;
+}
+
+// unlink from table, caller releases it
+void NodeMagick::removeFlight( Flight_t *flight )
+{
+    Flight_t **ptr = &flights[flight->key % FLIGHT_BUCKETS];
+    
+    while( *ptr && *ptr != flight ){
+        ptr = &(*ptr)->next;
+    }
+    if( *ptr ){
+        *ptr = flight->next;
+    }
+}
+
+// MARK: cancellation
+Local<Object> NodeMagick::jobHandle( unsigned int id )
+{
+    Local<Object> job = jobTemplate->GetFunction()->NewInstance();
+    
+    job->SetInternalField( 0, Integer::NewFromUnsigned( id ) );
+    job->Set( String::NewSymbol("id"), Integer::NewFromUnsigned( id ) );
+    
+    return job;
+}
+
+Local<Value> NodeMagick::jobError( const char *msg, const char *code )
+{
+    Local<Value> err = Exception::Error( String::New( msg ) );
+    
+    if( code ){
+        err->ToObject()->Set( String::NewSymbol("code"), String::NewSymbol( code ) );
+    }
+    
+    return err;
+}
+
+// returns 1 if the job will call back with ECANCELED
+int NodeMagick::cancelJob( unsigned int id )
+{
+    Baton_t *baton = jobs[id % JOB_BUCKETS];
+    Baton_t *prev = NULL;
+    Baton_t *item;
+    FlightWaiter_t *waiter;
+    int i;
+    
+    while( baton && baton->id != id ){
+        baton = (Baton_t*)baton->jnext;
+    }
+    // attached to an identical job
+    if( !baton )
+    {
+        for( i = 0; i < FLIGHT_BUCKETS; i++ )
+        {
+            for( Flight_t *flight = flights[i]; flight; flight = flight->next )
+            {
+                for( waiter = flight->waiters; waiter; waiter = waiter->next )
+                {
+                    if( waiter->id == id ){
+                        i = !waiter->cancelled;
+                        waiter->cancelled = 1;
+                        return i;
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+    else if( baton->cancelled || baton->detached ){
+        return 0;
+    }
+    // others still want the result
+    if( baton->flight )
+    {
+        for( waiter = baton->flight->waiters; waiter && waiter->cancelled; waiter = waiter->next );
+        if( waiter ){
+            baton->detached = 1;
+            return 1;
+        }
+    }
+    
+    baton->cancelled = 1;
+    // identical jobs queued from now on must not get ECANCELED
+    if( baton->flight ){
+        removeFlight( baton->flight );
+    }
+    // drop from queue if no worker took it yet
+    i = baton->priority - JOB_PRI_MIN;
+    pthread_mutex_lock( &pool.lock );
+    for( item = pool.head[i]; item && item != baton; item = (Baton_t*)item->next ){
+        prev = item;
+    }
+    if( item )
+    {
+        if( prev ){
+            prev->next = baton->next;
+        }
+        else {
+            pool.head[i] = (Baton_t*)baton->next;
+        }
+        if( pool.tail[i] == baton ){
+            pool.tail[i] = prev;
+        }
+        pool.queued--;
+        pool.cancelled++;
+    }
+    pthread_mutex_unlock( &pool.lock );
+    
+    // call back from the loop, never from inside cancel()
+    if( item )
+    {
+        baton->errstr = strdup( "job cancelled" );
+        baton->errcode = "ECANCELED";
+        baton->next = NULL;
+        pthread_mutex_lock( &pool.donelock );
+        if( pool.donetail ){
+            pool.donetail->next = baton;
+        }
+        else {
+            pool.donehead = baton;
+        }
+        pool.donetail = baton;
+        pthread_mutex_unlock( &pool.donelock );
+        ev_async_send( EV_DEFAULT_UC, &pool.notifier );
+    }
+    
+    return 1;
+}
+
+Handle<Value> NodeMagick::fnCancel( const Arguments &argv )
+{
+    HandleScope scope;
+    Local<Value> id = argv.This()->GetInternalField( 0 );
+    
+    return scope.Close( Boolean::New( id->IsUint32() && cancelJob( id->Uint32Value() ) ) );
+}
+
+// called by ImageMagick while reading, transforming and writing;
+// returning false aborts the current operation
+MagickBooleanType NodeMagick::progressMonitor( const char *, const MagickOffsetType, 
+                                               const MagickSizeType, void *client )
+{
+    Baton_t *baton = ((NodeMagick*)client)->running;
+    
+    if( baton && ( baton->cancelled || ( baton->deadline && nowMsec() > baton->deadline ) ) ){
+        return MagickFalse;
+    }
+    
+    return MagickTrue;
+}
+
+// ClearMagickWand drops the monitor, re-arm after each clear
+void NodeMagick::armMonitor( MagickWand *target )
+{
+    MagickSetProgressMonitor( target, progressMonitor, (void*)this );
+    if( MagickGetNumberImages( target ) ){
+        MagickSetImageProgressMonitor( target, progressMonitor, (void*)this );
+    }
+}
+
+Handle<Value> NodeMagick::New( const Arguments& argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = new NodeMagick();
+    Handle<Value> retval = Undefined();
+    
+    if( !ctx->wand ){
+        delete ctx;
+        retval = ThrowException( Exception::Error( String::New(strerror(ENOMEM)) ) );
+    }
+    else {
+        ctx->Wrap( argv.This() );
+        retval = argv.This();
+    }
+    
+    return scope.Close( retval );
+}
+
+
+void NodeMagick::freeBlob( char *data, void * )
+{
+    MagickRelinquishMemory( data );
+}
+
+char *NodeMagick::loadImage( const char *path, const void *data, size_t len, LoadOpts_t *opts )
+{
+    char *retval = NULL;
+    MagickBooleanType status;
+    double t;
+    void *mapped = NULL;
+    unsigned char *filebuf = NULL;
+    
+    // disposed
+    if( !wand && !( wand = acquireWand() ) ){
+        return strdup( strerror(ENOMEM) );
+    }
+    else if( attached ){
+        ClearMagickWand( wand );
+        disposeImage();
+    }
+    armMonitor( wand );
+    
+    t = nowMsec();
+    // decode from the mapping, keep the path for format detection
+    if( path && opts->mmap && ( data = mapFile( path, &len ) ) ){
+        mapped = (void*)data;
+    }
+    jstats.bytesIn = ( path ) ? fileSize( path ) : len;
+    // content address for the cache: a file is read once, then hashed and
+    // decoded from the same bytes. a lazy file is hashed by saveImage when
+    // it is decoded, the file may change in between
+    hashed = 0;
+    if( ( cache.maxbytes || cache.dir ) && !( path && opts->lazy ) )
+    {
+        if( !data ){
+            data = filebuf = readFile( path, &len );
+        }
+        if( data ){
+            srcHash = fnv1a( data, len, FNV_OFFSET );
+            hashed = 1;
+        }
+    }
+    // single-flight: content when hashed, else a file by name and version.
+    // a buffer not hashed here gets its identity from its first save
+    if( hashed ){
+        srcId = srcHash;
+    }
+    else if( path )
+    {
+        unsigned long long id;
+        
+        srcId = ( fileIdentity( path, &id ) == 0 ) ? id : fnv1a( path, strlen( path ), FNV_OFFSET );
+    }
+    else {
+        srcId = 0;
+    }
+    // read header first, pixels are decoded by saveImage in lazy mode
+    if( opts->lazy || opts->maxwidth || opts->maxheight || opts->maxarea )
+    {
+        if( !data ){
+            status = MagickPingImage( wand, path );
+        }
+        else {
+            if( path ){
+                MagickSetFilename( wand, path );
+            }
+            status = MagickPingImageBlob( wand, data, len );
+        }
+        MagickSetFirstIterator( wand );
+        // refuse before allocating any pixel
+        if( status == MagickTrue && ( retval = checkLimits( wand, opts ) ) ){
+            if( mapped ){
+                munmap( mapped, len );
+            }
+            free( filebuf );
+            ClearMagickWand( wand );
+            disposeImage();
+            return retval;
+        }
+        else if( status == MagickTrue && !opts->lazy )
+        {
+            ClearMagickWand( wand );
+            armMonitor( wand );
+            if( !data ){
+                status = MagickReadImage( wand, path );
+            }
+            else {
+                if( path ){
+                    MagickSetFilename( wand, path );
+                }
+                status = MagickReadImageBlob( wand, data, len );
+            }
+        }
+    }
+    else if( !data ){
+        status = MagickReadImage( wand, path );
+    }
+    else {
+        if( path ){
+            MagickSetFilename( wand, path );
+        }
+        status = MagickReadImageBlob( wand, data, len );
+    }
+    jstats.msec[PHASE_DECODE] += nowMsec() - t;
+    // never kept across calls: a file truncated before a deferred decode
+    // would fault on the mapping, the deferred decode reads by name
+    if( mapped ){
+        munmap( mapped, len );
+    }
+    free( filebuf );
+    notePeak( wandBytes( wand ) );
+    
+    if( status == MagickFalse ){
+        WandStrError(wand,retval);
+    }
+    else {
+        attached = 1;
+        if( path ){
+            src = strdup(path);
+        }
+        lazy = opts->lazy;
+        if( opts->lazy ){
+            deferred = 1;
+            blob = ( path ) ? NULL : data;
+            bloblen = ( path ) ? 0 : len;
+        }
+        format = MagickGetImageFormat( wand );
+        orientation = MagickGetImageOrientation( wand );
+        maxframes = opts->maxframes;
+        framestep = opts->framestep;
+        size.w = cur.w = MagickGetImageWidth( wand );
+        size.h = cur.h = MagickGetImageHeight( wand );
+        size.aspect = cur.aspect = (double)size.w/(double)size.h;
+        nops = 0;
+    }
+    
+    return retval;
+}
+
+// ratio: scale hint from decodeRatio, set to the scale of the decoded
+// image relative to the source
+char *NodeMagick::decodeImage( double *ratio )
+{
+    char *retval = NULL;
+    MagickBooleanType status;
+    double t = nowMsec();
+    
+    // drop pinged image
+    ClearMagickWand( wand );
+    armMonitor( wand );
+    // let the decoder scale down (jpeg DCT scaling) to no less than the
+    // planned output size
+    if( *ratio < 1.0 )
+    {
+        char hint[64];
+        
+        snprintf( hint, sizeof(hint), "%lux%lu", 
+                  (unsigned long)ceil( size.w * *ratio ), 
+                  (unsigned long)ceil( size.h * *ratio ) );
+        MagickSetOption( wand, "jpeg:size", hint );
+    }
+    
+    if( blob ){
+        // format detection of a lazy file read by saveImage
+        if( src ){
+            MagickSetFilename( wand, src );
+        }
+        status = MagickReadImageBlob( wand, blob, bloblen );
+    }
+    else {
+        status = MagickReadImage( wand, src );
+    }
+    jstats.msec[PHASE_DECODE] += nowMsec() - t;
+    notePeak( wandBytes( wand ) );
+    
+    if( status == MagickFalse ){
+        WandStrError(wand,retval);
+    }
+    else {
+        *ratio = (double)MagickGetImageWidth( wand ) / (double)size.w;
+        deferred = 0;
+    }
+    
+    return retval;
+}
+
+// scale of the raw image the decoder may produce without losing output
+// quality: set by the first resize, or by the given output size when no
+// resize is planned. 1 if an op before that does not scale uniformly.
+double NodeMagick::decodeRatio( unsigned long w, unsigned long h )
+{
+    double ratio = 0;
+    unsigned int i;
+    
+    for( i = 0; i < nops && !ratio; i++ )
+    {
+        switch( ops[i].type )
+        {
+            case OP_RESIZE:
+                ratio = fmax( (double)ops[i].w / (double)ops[i].iw, 
+                              (double)ops[i].h / (double)ops[i].ih );
+            break;
+            
+            case OP_ROTATE:
+                if( fmod( ops[i].arg0, 90 ) != 0 ){
+                    return 1.0;
+                }
+            break;
+            
+            case OP_CROP:
+            case OP_FLIP:
+            case OP_FLOP:
+            case OP_AUTO_ORIENT:
+            break;
+            
+            default:
+                return 1.0;
+        }
+    }
+    if( !ratio && w && h ){
+        ratio = fmax( (double)w / (double)cur.w, (double)h / (double)cur.h );
+    }
+    
+    return ( ratio > 0 && ratio < 1.0 ) ? ratio : 1.0;
+}
+
+unsigned int NodeMagick::optimizeOps( ImageOp_t *in, unsigned int nin, ImageOp_t *out )
+{
+    unsigned int nout = 0;
+    unsigned int i;
+    
+    for( i = 0; i < nin; i++ )
+    {
+        ImageOp_t *op = &in[i];
+        ImageOp_t *prev = ( nout ) ? &out[nout-1] : NULL;
+        
+        // no-op
+        if( ( ( op->type == OP_CROP || op->type == OP_EXTEND ) && 
+              !op->x && !op->y && op->w == op->iw && op->h == op->ih ) || 
+            ( op->type == OP_RESIZE && op->w == op->iw && op->h == op->ih ) || 
+            ( op->type == OP_ROTATE && fmod( op->arg0, 360 ) == 0 ) ){
+            continue;
+        }
+        else if( prev )
+        {
+            // crop of crop
+            if( prev->type == OP_CROP && op->type == OP_CROP ){
+                prev->x += op->x;
+                prev->y += op->y;
+                prev->w = op->w;
+                prev->h = op->h;
+                continue;
+            }
+            // resize of resize
+            else if( prev->type == OP_RESIZE && op->type == OP_RESIZE ){
+                prev->w = op->w;
+                prev->h = op->h;
+                continue;
+            }
+            else if( prev->type == OP_CROP_RESIZE && op->type == OP_RESIZE ){
+                prev->ow = op->w;
+                prev->oh = op->h;
+                continue;
+            }
+            // resample only the cropped region, see applyOps
+            else if( prev->type == OP_CROP && op->type == OP_RESIZE ){
+                prev->type = OP_CROP_RESIZE;
+                prev->ow = op->w;
+                prev->oh = op->h;
+                continue;
+            }
+            // cancel out
+            else if( ( prev->type == OP_FLIP && op->type == OP_FLIP ) || 
+                     ( prev->type == OP_FLOP && op->type == OP_FLOP ) ){
+                nout--;
+                continue;
+            }
+            // right angles add up without changing the canvas
+            else if( prev->type == OP_ROTATE && op->type == OP_ROTATE && 
+                     fmod( prev->arg0, 90 ) == 0 && fmod( op->arg0, 90 ) == 0 )
+            {
+                prev->arg0 += op->arg0;
+                if( fmod( prev->arg0, 360 ) == 0 ){
+                    nout--;
+                }
+                continue;
+            }
+        }
+        out[nout++] = *op;
+    }
+    
+    return nout;
+}
+
+MagickBooleanType NodeMagick::orientWand( MagickWand *target )
+{
+    MagickBooleanType status = MagickTrue;
+    PixelWand *bg;
+    
+    switch( MagickGetImageOrientation( target ) )
+    {
+        case TopRightOrientation:
+            status = MagickFlopImage( target );
+        break;
+        
+        case BottomRightOrientation:
+        case RightTopOrientation:
+        case LeftBottomOrientation:
+            if( !( bg = NewPixelWand() ) ){
+                return MagickFalse;
+            }
+            status = MagickRotateImage( target, bg, 
+                ( MagickGetImageOrientation( target ) == BottomRightOrientation ) ? 180 : 
+                ( MagickGetImageOrientation( target ) == RightTopOrientation ) ? 90 : 270 );
+            DestroyPixelWand( bg );
+        break;
+        
+        case BottomLeftOrientation:
+            status = MagickFlipImage( target );
+        break;
+        
+        case LeftTopOrientation:
+            status = MagickTransposeImage( target );
+        break;
+        
+        case RightBottomOrientation:
+            status = MagickTransverseImage( target );
+        break;
+        
+        default:
+            return MagickTrue;
+    }
+    if( status == MagickTrue ){
+        status = MagickSetImageOrientation( target, TopLeftOrientation );
+    }
+    
+    return status;
+}
+
+// run optimized operations, geometry before the first resample is
+// multiplied by ratio to map the planned size onto a downscaled decode
+char *NodeMagick::applyOps( MagickWand *target, double ratio, JobStats_t *js )
+{
+    char *retval = NULL;
+    MagickBooleanType status = MagickTrue;
+    ImageOp_t list[MAX_OPS];
+    unsigned int nlist = optimizeOps( ops, nops, list );
+    unsigned int i;
+    double before, t;
+    
+    for( i = 0; i < nlist && status == MagickTrue; i++ )
+    {
+        ImageOp_t *op = &list[i];
+        PixelWand *bg = NULL;
+        int phase = PHASE_TRANSFORM;
+        
+        before = wandBytes( target );
+        t = nowMsec();
+        switch( op->type )
+        {
+            case OP_CROP:
+                phase = PHASE_CROP;
+                status = MagickCropImage( target, op->w * ratio, op->h * ratio, 
+                                          op->x * ratio, op->y * ratio );
+            break;
+            
+            case OP_CROP_RESIZE:
+                phase = PHASE_RESIZE;
+                // 8 bit sRGB: native resampler reads the region directly
+                if( nativeResize( target, op->x * ratio, op->y * ratio, op->w * ratio, 
+                                  op->h * ratio, op->ow, op->oh, filter, thumbnail, &status ) ){
+                    ratio = 1.0;
+                    break;
+                }
+                // otherwise through the smaller intermediate: the cropped
+                // region, or the whole frame scaled down before the crop
+                else
+                {
+                    double sx = (double)op->ow / ( op->w * ratio );
+                    double sy = (double)op->oh / ( op->h * ratio );
+                    unsigned long fw = MagickGetImageWidth( target );
+                    unsigned long fh = MagickGetImageHeight( target );
+                    
+                    if( fw * sx * fh * sy < op->w * ratio * op->h * ratio )
+                    {
+                        unsigned long rw = ceil( fw * sx );
+                        unsigned long rh = ceil( fh * sy );
+                        long x = op->x * ratio * sx + 0.5;
+                        long y = op->y * ratio * sy + 0.5;
+                        
+                        status = resizeWand( target, rw, rh, filter, thumbnail );
+                        js->msec[PHASE_RESIZE] += nowMsec() - t;
+                        t = nowMsec();
+                        phase = PHASE_CROP;
+                        if( status == MagickTrue ){
+                            status = MagickCropImage( target, op->ow, op->oh, 
+                                                      ( x + op->ow > rw ) ? rw - op->ow : x, 
+                                                      ( y + op->oh > rh ) ? rh - op->oh : y );
+                        }
+                        ratio = 1.0;
+                        break;
+                    }
+                }
+                status = MagickCropImage( target, op->w * ratio, op->h * ratio, 
+                                          op->x * ratio, op->y * ratio );
+                js->msec[PHASE_CROP] += nowMsec() - t;
+                t = nowMsec();
+                if( status == MagickTrue ){
+                    status = resizeWand( target, op->ow, op->oh, filter, thumbnail );
+                }
+                ratio = 1.0;
+            break;
+            
+            case OP_RESIZE:
+                phase = PHASE_RESIZE;
+                status = resizeWand( target, op->w, op->h, filter, thumbnail );
+                ratio = 1.0;
+            break;
+            
+            case OP_ROTATE:
+                if( !( bg = NewPixelWand() ) ){
+                    status = MagickFalse;
+                    break;
+                }
+                PixelSetColor( bg, ( *op->color ) ? op->color : "none" );
+                status = MagickRotateImage( target, bg, op->arg0 );
+            break;
+            
+            case OP_FLIP:
+                status = MagickFlipImage( target );
+            break;
+            
+            case OP_FLOP:
+                status = MagickFlopImage( target );
+            break;
+            
+            case OP_AUTO_ORIENT:
+                status = orientWand( target );
+            break;
+            
+            case OP_SHARPEN:
+                status = MagickSharpenImage( target, op->arg0 * ratio, op->arg1 * ratio );
+            break;
+            
+            case OP_EXTEND:
+                if( !( bg = NewPixelWand() ) ){
+                    status = MagickFalse;
+                    break;
+                }
+                PixelSetColor( bg, ( *op->color ) ? op->color : "none" );
+                status = MagickSetImageBackgroundColor( target, bg );
+                if( status == MagickTrue ){
+                    status = MagickExtentImage( target, op->w * ratio, op->h * ratio, 
+                                                op->x * ratio, op->y * ratio );
+                }
+            break;
+        }
+        if( bg ){
+            DestroyPixelWand( bg );
+        }
+        js->msec[phase] += nowMsec() - t;
+        if( before + wandBytes( target ) > js->peakPixels ){
+            js->peakPixels = before + wandBytes( target );
+        }
+    }
+    if( status == MagickFalse ){
+        WandStrError(target,retval);
+    }
+    
+    return retval;
+}
+
+void *NodeMagick::frameThread( void *arg )
+{
+    FrameJob_t *job = (FrameJob_t*)arg;
+    NodeMagick *ctx = (NodeMagick*)job->ctx;
+    JobStats_t js;
+    char *errstr = NULL;
+    unsigned int idx;
+    int i;
+    
+    memset( &js, 0, sizeof( JobStats_t ) );
+    while( !errstr )
+    {
+        pthread_mutex_lock( &job->lock );
+        idx = ( job->errstr ) ? job->nframes : job->next++;
+        pthread_mutex_unlock( &job->lock );
+        if( idx >= job->nframes ){
+            break;
+        }
+        errstr = ctx->applyOps( job->frames[idx], job->ratio, &js );
+    }
+    
+    pthread_mutex_lock( &job->lock );
+    if( errstr && !job->errstr ){
+        job->errstr = errstr;
+    }
+    else if( errstr ){
+        free( errstr );
+    }
+    // threads overlap: longest thread per phase, memory adds up
+    for( i = 0; i < PHASE_NUM; i++ ){
+        job->stats.msec[i] = fmax( job->stats.msec[i], js.msec[i] );
+    }
+    job->stats.peakPixels += js.peakPixels;
+    pthread_mutex_unlock( &job->lock );
+    
+    return NULL;
+}
+
+// run operations on every frame of an animation in parallel and put
+// the frames back together with their delays
+char *NodeMagick::applyFrames( double ratio )
+{
+    char *retval = NULL;
+    unsigned long nimages = MagickGetNumberImages( wand );
+    unsigned int step = ( framestep > 1 ) ? framestep : 1;
+    MagickWand *coalesced, *out;
+    FrameJob_t job;
+    pthread_t *tids;
+    unsigned int nhelpers, ntids = 0, i;
+    double t;
+    
+    if( nimages < 2 || ( !nops && !maxframes && step == 1 ) ){
+        return applyOps( wand, ratio, &jstats );
+    }
+    
+    // full frames instead of deltas
+    t = nowMsec();
+    if( !( coalesced = MagickCoalesceImages( wand ) ) ){
+        WandStrError(wand,retval);
+        return retval;
+    }
+    memset( &job, 0, sizeof( FrameJob_t ) );
+    job.ctx = (void*)this;
+    job.ratio = ratio;
+    if( !( job.frames = (MagickWand**)calloc( nimages, sizeof( MagickWand* ) ) ) ){
+        DestroyMagickWand( coalesced );
+        return strdup( strerror(ENOMEM) );
+    }
+    // split, dropped frames extend the delay of the previous one kept
+    for( i = 0; i < nimages; i++ )
+    {
+        MagickSetIteratorIndex( coalesced, i );
+        if( i % step == 0 && maxframes && job.nframes >= maxframes ){
+            break;
+        }
+        else if( i % step == 0 ){
+            if( !( job.frames[job.nframes] = MagickGetImage( coalesced ) ) ){
+                break;
+            }
+            job.nframes++;
+        }
+        else if( job.nframes ){
+            MagickSetImageDelay( job.frames[job.nframes-1], 
+                MagickGetImageDelay( job.frames[job.nframes-1] ) + 
+                MagickGetImageDelay( coalesced ) );
+        }
+    }
+    DestroyMagickWand( coalesced );
+    jstats.msec[PHASE_TRANSFORM] += nowMsec() - t;
+    
+    // this thread takes frames too, helpers are taken from the pool's
+    // budget so concurrent animations do not multiply the threads
+    nhelpers = acquireHelpers( ( job.nframes > 1 ) ? job.nframes - 1 : 0 );
+    pthread_mutex_init( &job.lock, NULL );
+    if( nhelpers && ( tids = (pthread_t*)malloc( sizeof( pthread_t ) * nhelpers ) ) )
+    {
+        for( ntids = 0; ntids < nhelpers; ntids++ )
+        {
+            if( pthread_create( &tids[ntids], NULL, frameThread, &job ) != 0 ){
+                break;
+            }
+        }
+        frameThread( &job );
+        for( i = 0; i < ntids; i++ ){
+            pthread_join( tids[i], NULL );
+        }
+        free( tids );
+    }
+    else {
+        frameThread( &job );
+    }
+    releaseHelpers( nhelpers );
+    pthread_mutex_destroy( &job.lock );
+    for( i = 0; i < PHASE_NUM; i++ ){
+        jstats.msec[i] += job.stats.msec[i];
+    }
+    notePeak( job.stats.peakPixels );
+    
+    // reassemble
+    t = nowMsec();
+    if( !( retval = job.errstr ) )
+    {
+        if( !( out = NewMagickWand() ) ){
+            retval = strdup( strerror(ENOMEM) );
+        }
+        else
+        {
+            for( i = 0; i < job.nframes && !retval; i++ )
+            {
+                MagickSetImagePage( job.frames[i], MagickGetImageWidth( job.frames[i] ), 
+                                    MagickGetImageHeight( job.frames[i] ), 0, 0 );
+                if( MagickAddImage( out, job.frames[i] ) == MagickFalse ){
+                    WandStrError(out,retval);
+                }
+            }
+            if( retval ){
+                DestroyMagickWand( out );
+            }
+            else {
+                releaseWand( wand );
+                wand = out;
+                armMonitor( wand );
+                MagickSetFirstIterator( wand );
+            }
+        }
+    }
+    for( i = 0; i < job.nframes; i++ ){
+        DestroyMagickWand( job.frames[i] );
+    }
+    free( job.frames );
+    jstats.msec[PHASE_TRANSFORM] += nowMsec() - t;
+    
+    return retval;
+}
+
+ImageOp_t *NodeMagick::pushOp( ImageOp_e type )
+{
+    ImageOp_t *op;
+    
+    if( nops >= MAX_OPS ){
+        return NULL;
+    }
+    op = &ops[nops++];
+    memset( op, 0, sizeof( ImageOp_t ) );
+    op->type = type;
+    op->iw = cur.w;
+    op->ih = cur.h;
+    
+    return op;
+}
+
+// size before trailing resize, resize methods are relative to it
+ImageSize NodeMagick::baseSize( void )
+{
+    ImageSize base = cur;
+    
+    if( nops && ops[nops-1].type == OP_RESIZE ){
+        base.w = ops[nops-1].iw;
+        base.h = ops[nops-1].ih;
+        base.aspect = (double)base.w/(double)base.h;
+    }
+    
+    return base;
+}
+
+// 0: resize planned or not needed, -1: too many operations
+int NodeMagick::planResize( unsigned long w, unsigned long h )
+{
+    ImageOp_t *op = NULL;
+    
+    // replace trailing resize
+    if( nops && ops[nops-1].type == OP_RESIZE ){
+        op = &ops[nops-1];
+    }
+    else if( w == cur.w && h == cur.h ){
+        return 0;
+    }
+    else if( !( op = pushOp( OP_RESIZE ) ) ){
+        return -1;
+    }
+    op->w = cur.w = w;
+    op->h = cur.h = h;
+    cur.aspect = (double)w/(double)h;
+    
+    return 0;
+}
+
+// read-only mapping of a whole file, NULL if it can not be mapped.
+// MAP_PRIVATE does not snapshot the file: pages are read on access, so a
+// truncated file faults. loadImage unmaps before it returns and never
+// keeps the mapping for a deferred decode.
+void *NodeMagick::mapFile( const char *path, size_t *len )
+{
+    struct stat info;
+    void *map = NULL;
+    int fd = open( path, O_RDONLY );
+    
+    if( fd == -1 ){
+        return NULL;
+    }
+    if( fstat( fd, &info ) == 0 && S_ISREG( info.st_mode ) && info.st_size > 0 )
+    {
+        map = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( map == MAP_FAILED ){
+            map = NULL;
+        }
+        else {
+            // decoders read front to back, let the kernel read ahead and
+            // drop pages behind
+            madvise( map, info.st_size, MADV_SEQUENTIAL );
+            *len = info.st_size;
+        }
+    }
+    close( fd );
+    
+    return map;
+}
+
+// whole file in a malloc'd buffer, NULL if it can not be read
+unsigned char *NodeMagick::readFile( const char *path, size_t *len )
+{
+    struct stat info;
+    unsigned char *data = NULL;
+    size_t got = 0;
+    ssize_t n;
+    int fd = open( path, O_RDONLY );
+    
+    if( fd == -1 ){
+        return NULL;
+    }
+    if( fstat( fd, &info ) == 0 && S_ISREG( info.st_mode ) && info.st_size > 0 && 
+        ( data = (unsigned char*)malloc( info.st_size ) ) )
+    {
+        while( got < (size_t)info.st_size && 
+               ( ( n = read( fd, data + got, info.st_size - got ) ) > 0 || ( n == -1 && errno == EINTR ) ) ){
+            got += ( n > 0 ) ? n : 0;
+        }
+        // shrunk while reading
+        if( got < (size_t)info.st_size ){
+            free( data );
+            data = NULL;
+        }
+        else {
+            *len = got;
+        }
+    }
+    close( fd );
+    
+    return data;
+}
+
+// name and version of a file without reading it: path, inode, size and
+// modification time. only keys single-flight, never the cache: a file
+// rewritten within the same second keeps its identity
+int NodeMagick::fileIdentity( const char *path, unsigned long long *id )
+{
+    struct stat info;
+    
+    if( stat( path, &info ) != 0 ){
+        return -1;
+    }
+    *id = fnv1a( path, strlen( path ), FNV_OFFSET );
+    *id = fnv1a( &info.st_ino, sizeof( info.st_ino ), *id );
+    *id = fnv1a( &info.st_size, sizeof( info.st_size ), *id );
+    *id = fnv1a( &info.st_mtime, sizeof( info.st_mtime ), *id );
+    
+    return 0;
+}
+
+// normalized description of the output: source identity, decode mode,
+// output target, optimized operations and encoder settings
+int NodeMagick::jobSignature( const char *target, unsigned long long id, const EncodeOpts_t *eo, 
+                              char *sig, size_t len )
+{
+    ImageOp_t list[MAX_OPS];
+    unsigned int nlist = optimizeOps( ops, nops, list );
+    unsigned int i;
+    size_t pos;
+    
+    // a lazy load decodes with a size hint and gets different pixels,
+    // frame selection changes the frame count
+    pos = snprintf( sig, len, "%016llx|%d,%u,%u|%u|%s|%s|%d|%d", id, lazy, maxframes, framestep, quality, 
+                    ( format_to ) ? format_to : "", ( target ) ? target : "", 
+                    (int)filter, thumbnail );
+    for( i = 0; i < nlist && pos < len; i++ ){
+        pos += snprintf( sig + pos, len - pos, "|%d:%ld,%ld,%lu,%lu,%lu,%lu,%g,%g,%s", 
+                         list[i].type, list[i].x, list[i].y, list[i].w, list[i].h, 
+                         list[i].ow, list[i].oh, list[i].arg0, list[i].arg1, list[i].color );
+    }
+    if( eo && pos < len ){
+        pos += snprintf( sig + pos, len - pos, "|e:%d,%s,%d,%d,%d,%lu,%d,%d,%d,%zu,%zu,%d,%d", 
+                         eo->interlace, eo->sampling, eo->optimize, eo->level, eo->pngfilter, 
+                         eo->colors, eo->method, eo->lossless, eo->nearlossless, 
+                         eo->maxbytes, eo->minquality, eo->srgb, eo->keepicc );
+    }
+    
+    return ( pos < len ) ? 0 : -1;
+}
+
+// returns a copy allocated by ImageMagick, like MagickGetImageBlob
+unsigned char *NodeMagick::cacheGet( const char *sig, size_t *len )
+{
+    unsigned long long key = fnv1a( sig, strlen( sig ), FNV_OFFSET );
+    unsigned char *data = NULL;
+    char *dir = NULL;
+    CacheEntry_t *entry;
+    
+    pthread_mutex_lock( &cache.lock );
+    for( entry = cache.table[key % CACHE_BUCKETS]; entry; entry = entry->hnext )
+    {
+        if( entry->key == key && strcmp( entry->sig, sig ) == 0 )
+        {
+            // move to front
+            if( entry->prev ){
+                entry->prev->next = entry->next;
+                if( entry->next ){
+                    entry->next->prev = entry->prev;
+                }
+                else {
+                    cache.tail = entry->prev;
+                }
+                entry->prev = NULL;
+                entry->next = cache.head;
+                cache.head->prev = entry;
+                cache.head = entry;
+            }
+            if( ( data = (unsigned char*)AcquireMagickMemory( entry->len ) ) ){
+                memcpy( data, entry->data, entry->len );
+                *len = entry->len;
+                cache.hits++;
+            }
+            break;
+        }
+    }
+    if( !data && cache.dir ){
+        dir = strdup( cache.dir );
+    }
+    else if( !data ){
+        cache.misses++;
+    }
+    pthread_mutex_unlock( &cache.lock );
+    
+    // disk tier: signature terminated by '\0' followed by the image
+    if( dir )
+    {
+        char path[PATH_MAX];
+        size_t slen = strlen( sig ) + 1;
+        struct stat info;
+        unsigned char *buf = NULL;
+        int fd;
+        
+        snprintf( path, sizeof( path ), "%s/%016llx", dir, key );
+        if( ( fd = open( path, O_RDONLY ) ) != -1 )
+        {
+            if( fstat( fd, &info ) == 0 && (size_t)info.st_size > slen && 
+                ( buf = (unsigned char*)malloc( info.st_size ) ) && 
+                read( fd, buf, info.st_size ) == info.st_size && 
+                memcmp( buf, sig, slen ) == 0 && 
+                ( data = (unsigned char*)AcquireMagickMemory( info.st_size - slen ) ) ){
+                *len = info.st_size - slen;
+                memcpy( data, buf + slen, *len );
+            }
+            close( fd );
+        }
+        free( dir );
+        
+        pthread_mutex_lock( &cache.lock );
+        if( data ){
+            cache.diskHits++;
+            cacheInsert( sig, key, data, *len );
+        }
+        else {
+            cache.misses++;
+        }
+        pthread_mutex_unlock( &cache.lock );
+        if( buf ){
+            free( buf );
+        }
+    }
+    
+    return data;
+}
+
+void NodeMagick::cachePut( const char *sig, const unsigned char *data, size_t len )
+{
+    unsigned long long key = fnv1a( sig, strlen( sig ), FNV_OFFSET );
+    char *dir = NULL;
+    
+    pthread_mutex_lock( &cache.lock );
+    cacheInsert( sig, key, data, len );
+    if( cache.dir ){
+        dir = strdup( cache.dir );
+    }
+    pthread_mutex_unlock( &cache.lock );
+    
+    if( dir )
+    {
+        char path[PATH_MAX];
+        
+        snprintf( path, sizeof( path ), "%s/%016llx", dir, key );
+        if( writeFile( path, sig, strlen( sig ) + 1, data, len ) == 0 ){
+            pthread_mutex_lock( &cache.lock );
+            cache.diskWrites++;
+            pthread_mutex_unlock( &cache.lock );
+        }
+        free( dir );
+    }
+}
+
+// call with cache.lock held
+void NodeMagick::cacheInsert( const char *sig, unsigned long long key, const unsigned char *data, size_t len )
+{
+    CacheEntry_t *entry;
+    
+    if( len > cache.maxbytes ){
+        return;
+    }
+    // already inserted by a concurrent job
+    for( entry = cache.table[key % CACHE_BUCKETS]; entry; entry = entry->hnext )
+    {
+        if( entry->key == key && strcmp( entry->sig, sig ) == 0 ){
+            return;
+        }
+    }
+    if( !( entry = (CacheEntry_t*)calloc( 1, sizeof( CacheEntry_t ) ) ) ){
+        return;
+    }
+    else if( !( entry->sig = strdup( sig ) ) || 
+             !( entry->data = (unsigned char*)malloc( len ) ) ){
+        free( entry->sig );
+        free( entry );
+        return;
+    }
+    cacheEvict( cache.maxbytes - len );
+    memcpy( entry->data, data, len );
+    entry->len = len;
+    entry->key = key;
+    entry->hnext = cache.table[key % CACHE_BUCKETS];
+    cache.table[key % CACHE_BUCKETS] = entry;
+    entry->next = cache.head;
+    if( cache.head ){
+        cache.head->prev = entry;
+    }
+    else {
+        cache.tail = entry;
+    }
+    cache.head = entry;
+    cache.entries++;
+    cache.bytes += len;
+}
+
+// call with cache.lock held, drop least recently used entries
+void NodeMagick::cacheEvict( size_t maxbytes )
+{
+    while( cache.tail && cache.bytes > maxbytes )
+    {
+        CacheEntry_t *entry = cache.tail;
+        CacheEntry_t **ptr = &cache.table[entry->key % CACHE_BUCKETS];
+        
+        while( *ptr != entry ){
+            ptr = &(*ptr)->hnext;
+        }
+        *ptr = entry->hnext;
+        if( ( cache.tail = entry->prev ) ){
+            cache.tail->next = NULL;
+        }
+        else {
+            cache.head = NULL;
+        }
+        cache.entries--;
+        cache.bytes -= entry->len;
+        cache.evictions++;
+        free( entry->sig );
+        free( entry->data );
+        free( entry );
+    }
+}
+
+// write to a temporary file and rename it into place
+int NodeMagick::writeFile( const char *path, const char *head, size_t hlen, const unsigned char *data, size_t len )
+{
+    char tmp[PATH_MAX];
+    int fd;
+    int rc = -1;
+    
+    snprintf( tmp, sizeof( tmp ), "%s.XXXXXX", path );
+    if( ( fd = mkstemp( tmp ) ) == -1 ){
+        return -1;
+    }
+    if( ( !hlen || write( fd, head, hlen ) == (ssize_t)hlen ) && 
+        write( fd, data, len ) == (ssize_t)len && 
+        fchmod( fd, 0644 ) == 0 ){
+        rc = 0;
+    }
+    close( fd );
+    if( rc == 0 && rename( tmp, path ) != 0 ){
+        rc = -1;
+    }
+    if( rc != 0 ){
+        unlink( tmp );
+    }
+    
+    return rc;
+}
+
+Handle<Value> NodeMagick::getResampler( Local<String>, const AccessorInfo & )
+{
+    HandleScope scope;
+    return scope.Close( String::New( ( nativeResample ) ? resampleKernel() : "magick" ) );
+}
+
+void NodeMagick::setResampler( Local<String>, Local<Value> val, const AccessorInfo & )
+{
+    HandleScope scope;
+    String::Utf8Value name( val );
+    
+    if( !val->IsString() ){
+        ThrowException( Exception::TypeError( String::New( "resampler = 'auto'|'avx2'|'sse2'|'scalar'|'magick'" ) ) );
+    }
+    else if( strcmp( *name, "magick" ) == 0 ){
+        nativeResample = 0;
+    }
+    else if( resampleSelect( ( strcmp( *name, "auto" ) == 0 ) ? NULL : *name ) != 0 ){
+        ThrowException( Exception::Error( String::Concat( 
+            String::New( "resampler not available: " ), val->ToString() ) ) );
+    }
+    else {
+        nativeResample = 1;
+    }
+}
+
+Handle<Value> NodeMagick::fnCache( const Arguments &argv )
+{
+    HandleScope scope;
+    Local<Object> info = Object::New();
+    
+    if( argv.Length() > 0 && IsDefined( argv[0] ) && !argv[0]->IsObject() ){
+        return ThrowException( Exception::TypeError( String::New( "cache( [{ memory:Number, dir:String|null }] )" ) ) );
+    }
+    
+    pthread_mutex_lock( &cache.lock );
+    if( argv.Length() > 0 && argv[0]->IsObject() )
+    {
+        Local<Object> opts = argv[0]->ToObject();
+        Local<Value> v = opts->Get( String::NewSymbol("memory") );
+        
+        if( v->IsNumber() && v->NumberValue() >= 0 ){
+            cache.maxbytes = (size_t)v->IntegerValue();
+            cacheEvict( cache.maxbytes );
+        }
+        v = opts->Get( String::NewSymbol("dir") );
+        if( v->IsString() || v->IsNull() || v->IsFalse() )
+        {
+            if( cache.dir ){
+                free( cache.dir );
+                cache.dir = NULL;
+            }
+            if( v->IsString() && v->ToString()->Length() ){
+                cache.dir = strdup( *String::Utf8Value( v ) );
+            }
+        }
+    }
+    info->Set( String::NewSymbol("memory"), Number::New( cache.maxbytes ) );
+    info->Set( String::NewSymbol("dir"), ( cache.dir ) ? 
+               Handle<Value>( String::New( cache.dir ) ) : Handle<Value>( Null() ) );
+    info->Set( String::NewSymbol("entries"), Number::New( cache.entries ) );
+    info->Set( String::NewSymbol("bytes"), Number::New( cache.bytes ) );
+    info->Set( String::NewSymbol("hits"), Number::New( cache.hits ) );
+    info->Set( String::NewSymbol("misses"), Number::New( cache.misses ) );
+    info->Set( String::NewSymbol("evictions"), Number::New( cache.evictions ) );
+    info->Set( String::NewSymbol("diskHits"), Number::New( cache.diskHits ) );
+    info->Set( String::NewSymbol("diskWrites"), Number::New( cache.diskWrites ) );
+    pthread_mutex_unlock( &cache.lock );
+    
+    return scope.Close( info );
+}
+
+// 1: crop planned, 0: same aspect ratio, -1: too many operations
+// as before the operation list: relative to the raw image (auto oriented
+// if that came first), replaces an earlier crop and runs before other ops
+int NodeMagick::planCrop( double aspect, int align )
+{
+    unsigned int slot = ( nops && ops[0].type == OP_AUTO_ORIENT ) ? 1 : 0;
+    int found = ( slot < nops && ops[slot].type == OP_CROP );
+    unsigned long w = ( slot && ops[0].arg0 ) ? size.h : size.w;
+    unsigned long h = ( slot && ops[0].arg0 ) ? size.w : size.h;
+    ImageOp_t *op;
+    
+    if( (double)w/(double)h == aspect )
+    {
+        // uncropped
+        if( found ){
+            memmove( &ops[slot], &ops[slot+1], ( nops - slot - 1 ) * sizeof( ImageOp_t ) );
+            nops--;
+            replayOps();
+        }
+        return 0;
+    }
+    else if( !found )
+    {
+        if( nops >= MAX_OPS ){
+            return -1;
+        }
+        memmove( &ops[slot+1], &ops[slot], ( nops - slot ) * sizeof( ImageOp_t ) );
+        nops++;
+    }
+    op = &ops[slot];
+    memset( op, 0, sizeof( ImageOp_t ) );
+    op->type = OP_CROP;
+    if( (double)w/(double)h > aspect )
+    {
+        op->w = h * aspect;
+        op->h = h;
+        switch( align )
+        {
+            case ALIGN_CENTER:
+                op->x = ( w - op->w ) / 2;
+            break;
+            
+            case ALIGN_RIGHT:
+                op->x = w - op->w;
+            break;
+        }
+    }
+    else
+    {
+        op->h = w / aspect;
+        op->w = w;
+        switch( align )
+        {
+            case ALIGN_MIDDLE:
+                op->y = ( h - op->h ) / 2;
+            break;
+            
+            case ALIGN_BOTTOM:
+                op->y = h - op->h;
+            break;
+        }
+    }
+    replayOps();
+    
+    return 1;
+}
+
+// input size of every op and the current size, from the raw image on.
+// resize and extend keep their absolute output size
+void NodeMagick::replayOps( void )
+{
+    unsigned long w = size.w;
+    unsigned long h = size.h;
+    unsigned long tmp;
+    unsigned int i;
+    
+    for( i = 0; i < nops; i++ )
+    {
+        ImageOp_t *op = &ops[i];
+        
+        op->iw = w;
+        op->ih = h;
+        switch( op->type )
+        {
+            case OP_EXTEND:
+                // centered on the new canvas
+                op->x = -( (long)op->w - (long)w ) / 2;
+                op->y = -( (long)op->h - (long)h ) / 2;
+                w = op->w;
+                h = op->h;
+            break;
+            
+            case OP_CROP:
+            case OP_RESIZE:
+                w = op->w;
+                h = op->h;
+            break;
+            
+            case OP_ROTATE:
+                rotatedSize( op->arg0, &w, &h );
+            break;
+            
+            case OP_AUTO_ORIENT:
+                if( op->arg0 ){
+                    tmp = w;
+                    w = h;
+                    h = tmp;
+                }
+            break;
+            
+            default:
+            break;
+        }
+    }
+    cur.w = w;
+    cur.h = h;
+    cur.aspect = (double)w/(double)h;
+}
+
+// bounding box of rotated image
+void NodeMagick::rotatedSize( double degrees, unsigned long *w, unsigned long *h )
+{
+    double rad = degrees * M_PI / 180.0;
+    double dw = *w;
+    double dh = *h;
+    
+    if( fmod( degrees, 90 ) == 0 )
+    {
+        if( fmod( degrees, 180 ) != 0 ){
+            *w = dh;
+            *h = dw;
+        }
+    }
+    else {
+        *w = ceil( fabs( dw * cos( rad ) ) + fabs( dh * sin( rad ) ) );
+        *h = ceil( fabs( dw * sin( rad ) ) + fabs( dh * cos( rad ) ) );
+    }
+}
+
+// every frame is decoded, so each one is checked against the size limits
+// and the area limit also applies to the sum over all frames
+char *NodeMagick::checkLimits( MagickWand *target, LoadOpts_t *opts )
+{
+    unsigned long w, h;
+    unsigned long nframes = 0;
+    double total = 0;
+    char msg[128];
+    char *retval = NULL;
+    
+    MagickResetIterator( target );
+    while( !retval && MagickNextImage( target ) != MagickFalse )
+    {
+        w = MagickGetImageWidth( target );
+        h = MagickGetImageHeight( target );
+        total += (double)w * (double)h;
+        nframes++;
+        if( ( opts->maxwidth && w > opts->maxwidth ) || 
+            ( opts->maxheight && h > opts->maxheight ) || 
+            ( opts->maxarea && (double)w * (double)h > opts->maxarea ) ){
+            snprintf( msg, sizeof(msg), "image size %lux%lu exceeds limits", w, h );
+            retval = strdup( msg );
+        }
+    }
+    if( !retval && opts->maxarea && total > opts->maxarea ){
+        snprintf( msg, sizeof(msg), "total area of %lu frames exceeds limits", nframes );
+        retval = strdup( msg );
+    }
+    MagickSetFirstIterator( target );
+    
+    return retval;
+}
+
+int NodeMagick::parseLoadOpts( Local<Value> val, LoadOpts_t *opts )
+{
+    memset( opts, 0, sizeof( LoadOpts_t ) );
+    if( IsDefined( val ) )
+    {
+        Local<Object> obj;
+        Local<Object> limits;
+        
+        if( !val->IsObject() || val->IsFunction() ){
+            return -1;
+        }
+        obj = val->ToObject();
+        opts->lazy = obj->Get( String::NewSymbol("lazy") )->BooleanValue();
+        opts->mmap = obj->Get( String::NewSymbol("mmap") )->BooleanValue();
+        val = obj->Get( String::NewSymbol("limits") );
+        if( val->IsObject() )
+        {
+            limits = val->ToObject();
+            val = limits->Get( String::NewSymbol("width") );
+            opts->maxwidth = ( val->IsNumber() ) ? val->Uint32Value() : 0;
+            val = limits->Get( String::NewSymbol("height") );
+            opts->maxheight = ( val->IsNumber() ) ? val->Uint32Value() : 0;
+            val = limits->Get( String::NewSymbol("area") );
+            opts->maxarea = ( val->IsNumber() ) ? val->NumberValue() : 0;
+        }
+        val = obj->Get( String::NewSymbol("maxFrames") );
+        opts->maxframes = ( val->IsNumber() ) ? val->Uint32Value() : 0;
+        val = obj->Get( String::NewSymbol("frameStep") );
+        opts->framestep = ( val->IsNumber() ) ? val->Uint32Value() : 0;
+        val = obj->Get( String::NewSymbol("deadline") );
+        opts->deadline = ( val->IsNumber() ) ? val->Uint32Value() : 0;
+    }
+    
+    return 0;
+}
+
+int NodeMagick::parseEncodeOpts( Local<Value> val, EncodeOpts_t *opts )
+{
+    memset( opts, 0, sizeof( EncodeOpts_t ) );
+    opts->interlace = opts->optimize = opts->level = opts->pngfilter = -1;
+    opts->method = opts->lossless = opts->nearlossless = -1;
+    if( IsDefined( val ) )
+    {
+        Local<Object> obj;
+        
+        if( !val->IsObject() || val->IsFunction() ){
+            return -1;
+        }
+        obj = val->ToObject();
+        val = obj->Get( String::NewSymbol("progressive") );
+        if( IsDefined( val ) ){
+            opts->interlace = val->BooleanValue();
+        }
+        val = obj->Get( String::NewSymbol("sampling") );
+        if( IsDefined( val ) )
+        {
+            String::Utf8Value str( val );
+            
+            if( !val->IsString() || str.length() >= (int)sizeof( opts->sampling ) || 
+                strspn( *str, "0123456789.x,:" ) != (size_t)str.length() ){
+                return -1;
+            }
+            strcpy( opts->sampling, *str );
+        }
+        val = obj->Get( String::NewSymbol("optimize") );
+        if( IsDefined( val ) ){
+            opts->optimize = val->BooleanValue();
+        }
+        val = obj->Get( String::NewSymbol("level") );
+        if( val->IsNumber() ){
+            opts->level = (int)fmin( fmax( val->NumberValue(), 0 ), 9 );
+        }
+        val = obj->Get( String::NewSymbol("pngFilter") );
+        if( val->IsNumber() ){
+            opts->pngfilter = (int)fmin( fmax( val->NumberValue(), 0 ), 5 );
+        }
+        val = obj->Get( String::NewSymbol("colors") );
+        if( val->IsNumber() && val->NumberValue() >= 2 ){
+            opts->colors = (unsigned long)fmin( val->NumberValue(), 65536 );
+        }
+        val = obj->Get( String::NewSymbol("method") );
+        if( val->IsNumber() ){
+            opts->method = (int)fmin( fmax( val->NumberValue(), 0 ), 6 );
+        }
+        val = obj->Get( String::NewSymbol("lossless") );
+        if( IsDefined( val ) ){
+            opts->lossless = val->BooleanValue();
+        }
+        val = obj->Get( String::NewSymbol("nearLossless") );
+        if( val->IsNumber() ){
+            opts->nearlossless = (int)fmin( fmax( val->NumberValue(), 0 ), 100 );
+        }
+        val = obj->Get( String::NewSymbol("maxBytes") );
+        if( val->IsNumber() && val->NumberValue() >= 1 ){
+            opts->maxbytes = (size_t)val->NumberValue();
+        }
+        val = obj->Get( String::NewSymbol("minQuality") );
+        opts->minquality = ( val->IsNumber() ) ? (size_t)fmin( fmax( val->NumberValue(), 1 ), 100 ) : 1;
+        opts->srgb = obj->Get( String::NewSymbol("srgb") )->BooleanValue();
+        opts->keepicc = obj->Get( String::NewSymbol("keepIcc") )->BooleanValue();
+        opts->placeholder = obj->Get( String::NewSymbol("placeholder") )->BooleanValue();
+        val = obj->Get( String::NewSymbol("deadline") );
+        opts->deadline = ( val->IsNumber() && val->NumberValue() > 0 ) ? val->Uint32Value() : 0;
+    }
+    
+    return 0;
+}
+
+Handle<Value> NodeMagick::fnLoad( const Arguments& argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    int cbidx = ( argc > 1 && !argv[1]->IsFunction() ) ? 2 : 1;
+    bool callback = false;
+    LoadOpts_t opts;
+    
+    memset( &opts, 0, sizeof( LoadOpts_t ) );
+    if( argc < 1 || 
+        !( ( argv[0]->IsString() && argv[0]->ToString()->Length() ) || 
+           Buffer::HasInstance( argv[0] ) ) ||
+        ( cbidx == 2 && parseLoadOpts( argv[1], &opts ) != 0 ) ||
+        ( argc > cbidx && !( callback = argv[cbidx]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "load( path_to_image:String|image:Buffer, [options:Object], [callback:Function] )" ) ) );
+    }
+    else if( callback )
+    {
+        Baton_t *baton = newBaton( ctx, ASYNC_TASK_LOAD, argv[cbidx] );
+        
+        baton->lopts = opts;
+        if( opts.deadline ){
+            baton->deadline = nowMsec() + opts.deadline;
+        }
+        if( Buffer::HasInstance( argv[0] ) ){
+            // keep source buffer alive until the job is done
+            baton->buffer = Persistent<Object>::New( argv[0]->ToObject() );
+            baton->blob = (unsigned char*)Buffer::Data( baton->buffer );
+            baton->len = Buffer::Length( baton->buffer );
+        }
+        else {
+            baton->udata = strdup( *String::Utf8Value( argv[0] ) );
+        }
+        retval = queueBaton( baton );
+    }
+    else
+    {
+        char *errstr;
+        
+        pthread_mutex_lock( &ctx->lock );
+        ctx->beginStats();
+        if( Buffer::HasInstance( argv[0] ) ){
+            Local<Object> buf = argv[0]->ToObject();
+            errstr = ctx->loadImage( NULL, Buffer::Data( buf ), Buffer::Length( buf ), &opts );
+        }
+        else {
+            errstr = ctx->loadImage( *String::Utf8Value( argv[0] ), NULL, 0, &opts );
+        }
+        // deferred decode reads the source buffer at save time, a failed
+        // load dropped the previous image and no longer needs its buffer
+        if( !errstr || !ctx->attached )
+        {
+            if( !ctx->source.IsEmpty() ){
+                ctx->source.Dispose();
+                ctx->source.Clear();
+            }
+            if( !errstr && opts.lazy && Buffer::HasInstance( argv[0] ) ){
+                ctx->source = Persistent<Object>::New( argv[0]->ToObject() );
+            }
+        }
+        ctx->endStats( errstr != NULL );
+        ctx->lastStats = ctx->jstats;
+        ctx->trackMemory();
+        pthread_mutex_unlock( &ctx->lock );
+        ctx->reportMemory();
+        // failed
+        if( errstr ){
+            retval = ThrowException( Exception::Error( String::New( errstr ) ) );
+            free( errstr );
+        }
+    }
+    
+    return scope.Close( retval );
+}
+
+char *NodeMagick::saveImage( const char *path, unsigned char **blob, size_t *len, const EncodeOpts_t *eo )
+{
+    char *retval = NULL;
+    MagickBooleanType status = MagickTrue;
+    
+    if( !attached )
+    {
+        // nothing to encode
+        if( !path ){
+            retval = strdup( "image not loaded" );
+        }
+    }
+    else
+    {
+        // geometry was planned on the header size, map it onto the
+        // possibly downscaled decode
+        double ratio = 1.0;
+        double t;
+        char sig[4096];
+        // file writer picks the format from the extension
+        const char *ext = ( path ) ? strrchr( path, '.' ) : NULL;
+        unsigned char *filebuf = NULL;
+        size_t filelen = 0;
+        int cacheable;
+        
+        // a lazy file is read once, hashed and decoded from the same bytes
+        if( deferred && src && !this->blob && ( cache.maxbytes || cache.dir ) && 
+            ( filebuf = readFile( src, &filelen ) ) ){
+            srcHash = fnv1a( filebuf, filelen, FNV_OFFSET );
+            hashed = 1;
+        }
+        cacheable = ( hashed && jobSignature( ext, srcHash, eo, sig, sizeof( sig ) ) == 0 );
+        // cached output skips decode, unless the placeholder needs pixels
+        if( cacheable && !( eo && eo->placeholder ) )
+        {
+            unsigned char *data;
+            size_t dlen;
+            
+            t = nowMsec();
+            if( ( data = cacheGet( sig, &dlen ) ) )
+            {
+                if( !path ){
+                    *blob = data;
+                    *len = dlen;
+                }
+                else if( writeFile( path, NULL, 0, data, dlen ) != 0 ){
+                    retval = strdup( strerror(errno) );
+                }
+                if( path ){
+                    MagickRelinquishMemory( data );
+                }
+                jstats.bytesOut += dlen;
+                jstats.msec[PHASE_ENCODE] += nowMsec() - t;
+                free( filebuf );
+                return retval;
+            }
+        }
+        if( deferred )
+        {
+            ratio = decodeRatio( 0, 0 );
+            // the parameter blob shadows the member
+            if( filebuf ){
+                this->blob = filebuf;
+                bloblen = filelen;
+            }
+            retval = decodeImage( &ratio );
+            if( filebuf ){
+                free( filebuf );
+                this->blob = NULL;
+                bloblen = 0;
+            }
+            if( retval ){
+                return retval;
+            }
+        }
+        // crop, resize, ...
+        if( ( retval = applyFrames( ratio ) ) ){
+            return retval;
+        }
+        // quality 0-100
+        if( status == MagickTrue ){
+            status = MagickSetImageCompressionQuality( wand, quality );
+        }
+        // format
+        if( status == MagickTrue && format_to ){
+            status = MagickSetFormat( wand, format_to );
+            // blob encoder looks at the image format
+            if( status == MagickTrue && !path ){
+                status = MagickSetImageFormat( wand, format_to );
+            }
+        }
+        // convert to sRGB, remove profiles
+        if( status == MagickTrue ){
+            t = nowMsec();
+            if( eo && eo->srgb && ( retval = convertToSRGB( wand, eo->keepicc ) ) ){
+                return retval;
+            }
+            if( status == MagickTrue ){
+                status = MagickProfileImage( wand, ( eo && eo->keepicc ) ? "!icc,*" : "*", NULL, 1 );
+            }
+            jstats.msec[PHASE_PROFILE] += nowMsec() - t;
+        }
+        if( status == MagickTrue && eo && eo->placeholder ){
+            makePlaceholder( wand );
+        }
+        // interlace, subsampling, zlib level, ...
+        if( status == MagickTrue && eo ){
+            t = nowMsec();
+            status = setEncodeOpts( eo );
+            jstats.msec[PHASE_ENCODE] += nowMsec() - t;
+        }
+        // encode to memory until the output fits, write once
+        if( status == MagickTrue && eo && eo->maxbytes )
+        {
+            int multi = ( MagickGetNumberImages( wand ) > 1 );
+            unsigned char *data;
+            size_t dlen;
+            
+            t = nowMsec();
+            // blob encoder does not look at the file name
+            if( path && !format_to && ext ){
+                MagickSetFormat( wand, ext + 1 );
+                status = MagickSetImageFormat( wand, ext + 1 );
+            }
+            if( status == MagickTrue && !( retval = fitQuality( eo, multi, &data, &dlen ) ) )
+            {
+                jstats.bytesOut += dlen;
+                if( cacheable ){
+                    cachePut( sig, data, dlen );
+                }
+                if( !path ){
+                    *blob = data;
+                    *len = dlen;
+                }
+                else
+                {
+                    if( writeFile( path, NULL, 0, data, dlen ) != 0 ){
+                        retval = strdup( strerror(errno) );
+                    }
+                    MagickRelinquishMemory( data );
+                }
+            }
+            jstats.msec[PHASE_ENCODE] += nowMsec() - t;
+        }
+        // write
+        else if( status == MagickTrue )
+        {
+            t = nowMsec();
+            // animations are written as a whole
+            int multi = ( MagickGetNumberImages( wand ) > 1 );
+            
+            if( path ){
+                status = ( multi ) ? MagickWriteImages( wand, path, MagickTrue ) : 
+                                     MagickWriteImage( wand, path );
+                if( status == MagickTrue ){
+                    jstats.bytesOut += fileSize( path );
+                }
+            }
+            else if( !( *blob = ( multi ) ? MagickGetImagesBlob( wand, len ) : 
+                                            MagickGetImageBlob( wand, len ) ) ){
+                status = MagickFalse;
+            }
+            else {
+                jstats.bytesOut += *len;
+            }
+            jstats.msec[PHASE_ENCODE] += nowMsec() - t;
+            if( status == MagickTrue && cacheable )
+            {
+                // encoder picked the format from the file name, cache
+                // what it wrote
+                if( path )
+                {
+                    int fd = open( path, O_RDONLY );
+                    struct stat info;
+                    unsigned char *data;
+                    
+                    if( fd != -1 && fstat( fd, &info ) == 0 && 
+                        ( data = (unsigned char*)malloc( info.st_size ) ) )
+                    {
+                        if( read( fd, data, info.st_size ) == info.st_size ){
+                            cachePut( sig, data, info.st_size );
+                        }
+                        free( data );
+                    }
+                    if( fd != -1 ){
+                        close( fd );
+                    }
+                }
+                else {
+                    cachePut( sig, *blob, *len );
+                }
+            }
+        }
+        // failed
+        if( status == MagickFalse ){
+            WandStrError(wand,retval);
+        }
+        // options live in the wand, do not leak into the next save
+        if( eo ){
+            clearEncodeOpts( eo );
+        }
+    }
+    
+    return retval;
+}
+
+MagickBooleanType NodeMagick::setEncodeOpts( const EncodeOpts_t *eo )
+{
+    MagickBooleanType status = MagickTrue;
+    char val[32];
+    
+    if( eo->interlace != -1 ){
+        InterlaceType scheme = ( eo->interlace ) ? PlaneInterlace : NoInterlace;
+        
+        // restored by clearEncodeOpts
+        interlace = MagickGetInterlaceScheme( wand );
+        imageInterlace = MagickGetImageInterlaceScheme( wand );
+        MagickSetInterlaceScheme( wand, scheme );
+        status = MagickSetImageInterlaceScheme( wand, scheme );
+    }
+    if( status == MagickTrue && *eo->sampling ){
+        status = MagickSetOption( wand, "jpeg:sampling-factor", eo->sampling );
+    }
+    if( status == MagickTrue && eo->optimize != -1 ){
+        status = MagickSetOption( wand, "jpeg:optimize-coding", ( eo->optimize ) ? "true" : "false" );
+    }
+    if( status == MagickTrue && eo->level != -1 ){
+        snprintf( val, sizeof(val), "%d", eo->level );
+        status = MagickSetOption( wand, "png:compression-level", val );
+    }
+    if( status == MagickTrue && eo->pngfilter != -1 ){
+        snprintf( val, sizeof(val), "%d", eo->pngfilter );
+        status = MagickSetOption( wand, "png:compression-filter", val );
+    }
+    if( status == MagickTrue && eo->method != -1 ){
+        snprintf( val, sizeof(val), "%d", eo->method );
+        status = MagickSetOption( wand, "webp:method", val );
+    }
+    if( status == MagickTrue && eo->lossless != -1 ){
+        status = MagickSetOption( wand, "webp:lossless", ( eo->lossless ) ? "true" : "false" );
+    }
+    if( status == MagickTrue && eo->nearlossless != -1 ){
+        snprintf( val, sizeof(val), "%d", eo->nearlossless );
+        status = MagickSetOption( wand, "webp:near-lossless", val );
+    }
+    // palette, the png encoder writes an indexed image for <= 256 colors
+    if( status == MagickTrue && eo->colors )
+    {
+        double t = nowMsec();
+        
+        status = ( MagickGetNumberImages( wand ) > 1 ) ? 
+                 MagickQuantizeImages( wand, eo->colors, sRGBColorspace, 0, MagickFalse, MagickFalse ) : 
+                 MagickQuantizeImage( wand, eo->colors, sRGBColorspace, 0, MagickFalse, MagickFalse );
+        jstats.msec[PHASE_TRANSFORM] += nowMsec() - t;
+    }
+    
+    return status;
+}
+
+// BlurHash and dominant colour of the current image, from a copy scaled
+// down to PLACEHOLDER_SIZE
+void NodeMagick::makePlaceholder( MagickWand *target )
+{
+    unsigned long w = MagickGetImageWidth( target );
+    unsigned long h = MagickGetImageHeight( target );
+    double scale = ( w > h ) ? (double)PLACEHOLDER_SIZE / w : (double)PLACEHOLDER_SIZE / h;
+    unsigned long tw, th;
+    unsigned char *rgb = NULL;
+    MagickWand *tmp;
+    double t = nowMsec();
+    
+    jph.valid = 0;
+    scale = ( scale < 1.0 ) ? scale : 1.0;
+    tw = ( w * scale >= 1 ) ? (unsigned long)( w * scale + 0.5 ) : 1;
+    th = ( h * scale >= 1 ) ? (unsigned long)( h * scale + 0.5 ) : 1;
+    if( !( tmp = MagickGetImage( target ) ) ){
+        return;
+    }
+    // point sample large outputs first, the box filter averages the rest
+    if( ( w > tw * 8 && h > th * 8 && MagickSampleImage( tmp, tw * 8, th * 8 ) == MagickFalse ) || 
+        MagickScaleImage( tmp, tw, th ) == MagickFalse ){
+        DestroyMagickWand( tmp );
+        return;
+    }
+    if( ( rgb = (unsigned char*)malloc( tw * th * 3 ) ) && 
+        MagickExportImagePixels( tmp, 0, 0, tw, th, "RGB", CharPixel, rgb ) == MagickTrue && 
+        // components follow the aspect ratio
+        blurhashEncode( rgb, tw, th, ( tw >= th ) ? 4 : 3, ( tw >= th ) ? 3 : 4, 
+                        jph.hash, sizeof( jph.hash ) ) == 0 ){
+        dominantColor( rgb, tw * th, jph.color );
+        jph.valid = 1;
+    }
+    free( rgb );
+    DestroyMagickWand( tmp );
+    jstats.msec[PHASE_TRANSFORM] += nowMsec() - t;
+}
+
+Local<Value> NodeMagick::placeholderToObject( Placeholder_t *ph )
+{
+    Local<Object> obj = Object::New();
+    char color[8];
+    
+    snprintf( color, sizeof(color), "#%02x%02x%02x", ph->color[0], ph->color[1], ph->color[2] );
+    obj->Set( String::NewSymbol("blurhash"), String::New( ph->hash ) );
+    obj->Set( String::NewSymbol("color"), String::New( color ) );
+    
+    return obj;
+}
+
+// pixels of every image into sRGB: by the embedded icc profile through
+// the cached lcms2 transforms, by ImageMagick's colorspace math for
+// CMYK/Lab/... images without a usable profile
+// an embedded profile that can not be applied fails the save, stripping
+// it would leave wide gamut pixels to be shown as sRGB
+char *NodeMagick::convertToSRGB( MagickWand *target, int keepicc )
+{
+    char *retval = NULL;
+    MagickBooleanType status = MagickTrue;
+    size_t srgblen;
+    const unsigned char *srgb = colorSRGBProfile( &srgblen );
+    
+    MagickResetIterator( target );
+    while( status == MagickTrue && MagickNextImage( target ) != MagickFalse )
+    {
+        size_t icclen = 0;
+        unsigned char *icc = MagickGetImageProfile( target, "icc", &icclen );
+        ColorspaceType space = MagickGetImageColorspace( target );
+        int converted = 0;
+        
+        if( icc && icclen ){
+            converted = ( iccToSRGB( target, icc, icclen ) == 0 );
+        }
+        if( !converted && space != sRGBColorspace && space != RGBColorspace && 
+            space != GRAYColorspace && space != TransparentColorspace && 
+            space != UndefinedColorspace ){
+            status = MagickTransformImageColorspace( target, sRGBColorspace );
+            converted = 1;
+        }
+        // rgb pixels only the profile can map, e.g. Display P3
+        else if( !converted && icc && icclen ){
+            MagickRelinquishMemory( icc );
+            MagickSetFirstIterator( target );
+            return strdup( ( colorAvailable() ) ? "can not convert embedded icc profile to sRGB" : 
+                                                  "srgb needs color management, built without lcms2" );
+        }
+        if( icc ){
+            MagickRelinquishMemory( icc );
+        }
+        // old profile no longer describes the pixels
+        if( status == MagickTrue && converted && keepicc )
+        {
+            unsigned char *old = MagickRemoveImageProfile( target, "icc", &icclen );
+            
+            if( old ){
+                MagickRelinquishMemory( old );
+            }
+            if( srgb ){
+                status = MagickSetImageProfile( target, "icc", srgb, srgblen );
+            }
+        }
+    }
+    MagickSetFirstIterator( target );
+    if( status == MagickFalse ){
+        WandStrError(target,retval);
+    }
+    
+    return retval;
+}
+
+// convert the current image by its icc profile, -1 if lcms2 is missing,
+// the profile is broken or the colorspace is not supported
+int NodeMagick::iccToSRGB( MagickWand *target, const unsigned char *icc, size_t icclen )
+{
+    unsigned long w = MagickGetImageWidth( target );
+    unsigned long h = MagickGetImageHeight( target );
+    ColorspaceType space = MagickGetImageColorspace( target );
+    int alpha = ( MagickGetImageAlphaChannel( target ) == MagickTrue );
+    unsigned short *in, *out;
+    ColorLayout_e layout;
+    const char *map;
+    int retval = -1;
+    
+    if( !colorAvailable() ){
+        return -1;
+    }
+    else if( space == CMYKColorspace ){
+        layout = ( alpha ) ? COLOR_CMYKA : COLOR_CMYK;
+        map = ( alpha ) ? "CMYKA" : "CMYK";
+    }
+    else if( space == GRAYColorspace ){
+        layout = ( alpha ) ? COLOR_GRAYA : COLOR_GRAY;
+        map = ( alpha ) ? "IA" : "I";
+    }
+    else if( space == sRGBColorspace || space == RGBColorspace ){
+        layout = ( alpha ) ? COLOR_RGBA : COLOR_RGB;
+        map = ( alpha ) ? "RGBA" : "RGB";
+    }
+    else {
+        return -1;
+    }
+    
+    // 16 bits per sample keeps deep sources from banding
+    in = (unsigned short*)malloc( w * h * strlen( map ) * sizeof( unsigned short ) );
+    out = (unsigned short*)malloc( w * h * ( ( alpha ) ? 4 : 3 ) * sizeof( unsigned short ) );
+    if( in && out && 
+        MagickExportImagePixels( target, 0, 0, w, h, map, ShortPixel, in ) == MagickTrue && 
+        colorToSRGB( icc, icclen, layout, in, out, w * h ) == 0 && 
+        MagickSetImageColorspace( target, sRGBColorspace ) == MagickTrue && 
+        MagickImportImagePixels( target, 0, 0, w, h, ( alpha ) ? "RGBA" : "RGB", 
+                                 ShortPixel, out ) == MagickTrue ){
+        retval = 0;
+    }
+    free( in );
+    free( out );
+    
+    return retval;
+}
+
+void *NodeMagick::probeThread( void *arg )
+{
+    QualityProbe_t *probe = (QualityProbe_t*)arg;
+    
+    MagickSetCompressionQuality( probe->wand, probe->quality );
+    MagickResetIterator( probe->wand );
+    while( MagickNextImage( probe->wand ) != MagickFalse ){
+        MagickSetImageCompressionQuality( probe->wand, probe->quality );
+    }
+    MagickSetFirstIterator( probe->wand );
+    probe->blob = ( probe->multi ) ? MagickGetImagesBlob( probe->wand, &probe->len ) : 
+                                     MagickGetImageBlob( probe->wand, &probe->len );
+    
+    return NULL;
+}
+
+// search the highest quality between eo->minquality and the instance
+// quality whose output is no larger than eo->maxbytes. each round encodes
+// up to MAX_PROBES qualities in parallel on clones of the wand and
+// narrows the range to the gap above the best fit and below the closest
+// miss.
+char *NodeMagick::fitQuality( const EncodeOpts_t *eo, int multi, unsigned char **blob, size_t *len )
+{
+    QualityProbe_t probes[MAX_PROBES];
+    pthread_t tids[MAX_PROBES];
+    int started[MAX_PROBES];
+    long lo = eo->minquality;
+    long hi = ( quality > eo->minquality ) ? quality : eo->minquality;
+    unsigned char *best = NULL;
+    size_t bestlen = 0;
+    unsigned int nprobes, n, i;
+    int first = 1;
+    
+    // probe threads come out of the pool budget like frame helpers
+    nprobes = 1 + acquireHelpers( MAX_PROBES - 1 );
+    
+    while( lo <= hi )
+    {
+        n = ( hi - lo + 1 < (long)nprobes ) ? hi - lo + 1 : nprobes;
+        // highest first: the first round starts at the top of the range
+        // so a fitting full quality costs one encode, later rounds split
+        // the range evenly
+        for( i = 0; i < n; i++ )
+        {
+            memset( &probes[i], 0, sizeof( QualityProbe_t ) );
+            probes[i].quality = ( first ) ? hi - ( ( hi - lo + 1 ) * i ) / n : 
+                                            hi - ( ( hi - lo + 1 ) * ( i + 1 ) ) / ( n + 1 );
+            probes[i].multi = multi;
+            probes[i].wand = ( i ) ? CloneMagickWand( wand ) : wand;
+            if( !probes[i].wand ){
+                break;
+            }
+        }
+        n = i;
+        first = 0;
+        // this thread takes the first probe
+        for( i = 1; i < n; i++ )
+        {
+            if( !( started[i] = ( pthread_create( &tids[i], NULL, probeThread, &probes[i] ) == 0 ) ) ){
+                probeThread( &probes[i] );
+            }
+        }
+        probeThread( &probes[0] );
+        for( i = 1; i < n; i++ ){
+            if( started[i] ){
+                pthread_join( tids[i], NULL );
+            }
+            DestroyMagickWand( probes[i].wand );
+        }
+        
+        if( !probes[0].blob )
+        {
+            char *retval;
+            
+            WandStrError(wand,retval);
+            for( i = 1; i < n; i++ ){
+                MagickRelinquishMemory( probes[i].blob );
+            }
+            if( best ){
+                MagickRelinquishMemory( best );
+            }
+            releaseHelpers( nprobes - 1 );
+            return retval;
+        }
+        // probes are sorted by quality, the first fit is the best of
+        // this round and the probe before it the closest miss
+        for( i = 0; i < n && ( !probes[i].blob || probes[i].len > eo->maxbytes ); i++ );
+        if( i < n ){
+            if( best ){
+                MagickRelinquishMemory( best );
+            }
+            best = probes[i].blob;
+            bestlen = probes[i].len;
+            probes[i].blob = NULL;
+            lo = probes[i].quality + 1;
+        }
+        if( i > 0 ){
+            hi = probes[i-1].quality - 1;
+        }
+        for( i = 0; i < n; i++ ){
+            if( probes[i].blob ){
+                MagickRelinquishMemory( probes[i].blob );
+            }
+        }
+    }
+    releaseHelpers( nprobes - 1 );
+    
+    if( !best ){
+        char msg[128];
+        
+        snprintf( msg, sizeof(msg), "output exceeds %zu bytes at quality %zu", 
+                  eo->maxbytes, eo->minquality );
+        return strdup( msg );
+    }
+    *blob = best;
+    *len = bestlen;
+    
+    return NULL;
+}
+
+// undo setEncodeOpts, only what eo did set
+void NodeMagick::clearEncodeOpts( const EncodeOpts_t *eo )
+{
+    if( eo->interlace != -1 ){
+        MagickSetInterlaceScheme( wand, interlace );
+        MagickSetImageInterlaceScheme( wand, imageInterlace );
+    }
+    if( *eo->sampling ){
+        MagickDeleteOption( wand, "jpeg:sampling-factor" );
+    }
+    if( eo->optimize != -1 ){
+        MagickDeleteOption( wand, "jpeg:optimize-coding" );
+    }
+    if( eo->level != -1 ){
+        MagickDeleteOption( wand, "png:compression-level" );
+    }
+    if( eo->pngfilter != -1 ){
+        MagickDeleteOption( wand, "png:compression-filter" );
+    }
+    if( eo->method != -1 ){
+        MagickDeleteOption( wand, "webp:method" );
+    }
+    if( eo->lossless != -1 ){
+        MagickDeleteOption( wand, "webp:lossless" );
+    }
+    if( eo->nearlossless != -1 ){
+        MagickDeleteOption( wand, "webp:near-lossless" );
+    }
+}
+
+char *NodeMagick::renderImages( Rendition_t *list, unsigned int nlist, int placeholder )
+{
+    char *retval = NULL;
+    MagickBooleanType status = MagickTrue;
+    MagickWand *prev = wand;
+    MagickWand *out = NULL;
+    unsigned int *order;
+    unsigned long maxw = 0;
+    unsigned long maxh = 0;
+    double ratio = 1.0;
+    double t;
+    unsigned int i, j;
+    
+    if( !attached ){
+        return strdup( "image not loaded" );
+    }
+    else if( !( order = (unsigned int*)malloc( sizeof( unsigned int ) * nlist ) ) ){
+        return strdup( strerror(ENOMEM) );
+    }
+    
+    // resolve missing side by aspect ratio and sort largest first
+    for( i = 0; i < nlist; i++ )
+    {
+        if( !list[i].w ){
+            list[i].w = list[i].h * cur.aspect;
+        }
+        else if( !list[i].h ){
+            list[i].h = list[i].w / cur.aspect;
+        }
+        // extreme aspect ratios round the computed side down to 0
+        list[i].w = ( list[i].w ) ? list[i].w : 1;
+        list[i].h = ( list[i].h ) ? list[i].h : 1;
+        for( j = i; j > 0 && list[order[j-1]].w * list[order[j-1]].h < list[i].w * list[i].h; j-- ){
+            order[j] = order[j-1];
+        }
+        order[j] = i;
+        maxw = ( list[i].w > maxw ) ? list[i].w : maxw;
+        maxh = ( list[i].h > maxh ) ? list[i].h : maxh;
+    }
+    
+    // decode once for the largest rendition
+    if( deferred )
+    {
+        ratio = decodeRatio( maxw, maxh );
+        if( ( retval = decodeImage( &ratio ) ) ){
+            free( order );
+            return retval;
+        }
+    }
+    if( ( retval = applyOps( wand, ratio, &jstats ) ) ){
+        free( order );
+        return retval;
+    }
+    // remove profiles once for all renditions
+    if( status == MagickTrue ){
+        t = nowMsec();
+        status = MagickProfileImage( wand, "*", NULL, 1 );
+        jstats.msec[PHASE_PROFILE] += nowMsec() - t;
+    }
+    if( status == MagickFalse ){
+        WandStrError(wand,retval);
+        free( order );
+        return retval;
+    }
+    
+    for( i = 0; i < nlist && !retval; i++ )
+    {
+        Rendition_t *r = &list[order[i]];
+        const char *fmt = ( r->format ) ? r->format : format_to;
+        
+        // downscale from the previous, larger rendition
+        if( prev != wand && 
+            ( MagickGetImageWidth( prev ) < r->w || MagickGetImageHeight( prev ) < r->h ) ){
+            DestroyMagickWand( prev );
+            prev = wand;
+        }
+        if( !( out = CloneMagickWand( prev ) ) ){
+            retval = strdup( strerror(ENOMEM) );
+            break;
+        }
+        
+        if( MagickGetImageWidth( out ) != r->w || MagickGetImageHeight( out ) != r->h ){
+            t = nowMsec();
+            status = resizeWand( out, r->w, r->h, r->filter, r->thumbnail );
+            jstats.msec[PHASE_RESIZE] += nowMsec() - t;
+        }
+        notePeak( wandBytes( wand ) + wandBytes( out ) + 
+                  ( ( prev != wand ) ? wandBytes( prev ) : 0 ) );
+        if( status == MagickTrue ){
+            status = MagickSetImageCompressionQuality( out, r->quality );
+        }
+        if( status == MagickTrue && fmt ){
+            status = MagickSetFormat( out, fmt );
+            if( status == MagickTrue ){
+                status = MagickSetImageFormat( out, fmt );
+            }
+        }
+        if( status == MagickTrue )
+        {
+            t = nowMsec();
+            if( r->path ){
+                if( ( status = MagickWriteImage( out, r->path ) ) == MagickTrue ){
+                    jstats.bytesOut += fileSize( r->path );
+                }
+            }
+            else if( !( r->blob = MagickGetImageBlob( out, &r->len ) ) ){
+                status = MagickFalse;
+            }
+            else {
+                jstats.bytesOut += r->len;
+            }
+            jstats.msec[PHASE_ENCODE] += nowMsec() - t;
+        }
+        
+        if( status == MagickFalse ){
+            WandStrError(out,retval);
+            DestroyMagickWand( out );
+        }
+        else
+        {
+            if( prev != wand ){
+                DestroyMagickWand( prev );
+            }
+            prev = out;
+        }
+    }
+    // from the smallest rendition
+    if( !retval && placeholder ){
+        makePlaceholder( prev );
+    }
+    if( prev != wand ){
+        DestroyMagickWand( prev );
+    }
+    free( order );
+    
+    return retval;
+}
+
+int NodeMagick::parseRenditions( NodeMagick *ctx, Local<Value> val, Rendition_t **list, unsigned int *nlist )
+{
+    Local<Array> arr;
+    Rendition_t *r;
+    uint32_t len, i;
+    
+    if( !val->IsArray() || !( len = Local<Array>::Cast( val )->Length() ) ){
+        return -1;
+    }
+    else if( !( r = (Rendition_t*)calloc( len, sizeof( Rendition_t ) ) ) ){
+        return -1;
+    }
+    
+    arr = Local<Array>::Cast( val );
+    for( i = 0; i < len; i++ )
+    {
+        Local<Value> item = arr->Get( i );
+        Local<Object> spec;
+        Local<Value> v;
+        
+        if( !item->IsObject() ){
+            freeRenditions( r, i );
+            return -1;
+        }
+        spec = item->ToObject();
+        
+        v = spec->Get( String::NewSymbol("width") );
+        r[i].w = ( v->IsNumber() ) ? v->Uint32Value() : 0;
+        v = spec->Get( String::NewSymbol("height") );
+        r[i].h = ( v->IsNumber() ) ? v->Uint32Value() : 0;
+        v = spec->Get( String::NewSymbol("quality") );
+        r[i].quality = ( v->IsNumber() ) ? v->Uint32Value() : ctx->quality;
+        if( r[i].quality > 100 ){
+            r[i].quality = 100;
+        }
+        v = spec->Get( String::NewSymbol("thumbnail") );
+        r[i].thumbnail = ( IsDefined( v ) ) ? v->BooleanValue() : ctx->thumbnail;
+        r[i].filter = ctx->filter;
+        v = spec->Get( String::NewSymbol("filter") );
+        if( IsDefined( v ) && filterByName( *String::Utf8Value( v ), &r[i].filter ) != 0 ){
+            freeRenditions( r, i + 1 );
+            return -1;
+        }
+        v = spec->Get( String::NewSymbol("format") );
+        if( v->IsString() && v->ToString()->Length() ){
+            r[i].format = strdup( *String::Utf8Value( v ) );
+        }
+        v = spec->Get( String::NewSymbol("path") );
+        if( v->IsString() && v->ToString()->Length() ){
+            r[i].path = strdup( *String::Utf8Value( v ) );
+        }
+        // at least one side
+        if( !r[i].w && !r[i].h ){
+            freeRenditions( r, i + 1 );
+            return -1;
+        }
+    }
+    *list = r;
+    *nlist = len;
+    
+    return 0;
+}
+
+Local<Array> NodeMagick::renditionsToArray( Rendition_t *list, unsigned int nlist )
+{
+    Local<Array> arr = Array::New( nlist );
+    unsigned int i;
+    
+    for( i = 0; i < nlist; i++ )
+    {
+        if( list[i].path ){
+            arr->Set( i, String::New( list[i].path ) );
+        }
+        else if( list[i].blob ){
+            // hand over encoded image to js without copy
+            arr->Set( i, Local<Object>::New( Buffer::New( (char*)list[i].blob, list[i].len, freeBlob, NULL )->handle_ ) );
+            list[i].blob = NULL;
+        }
+    }
+    
+    return arr;
+}
+
+void NodeMagick::freeRenditions( Rendition_t *list, unsigned int nlist )
+{
+    unsigned int i;
+    
+    for( i = 0; i < nlist; i++ )
+    {
+        if( list[i].format ){
+            free( list[i].format );
+        }
+        if( list[i].path ){
+            free( list[i].path );
+        }
+        if( list[i].blob ){
+            MagickRelinquishMemory( list[i].blob );
+        }
+    }
+    free( list );
+}
+
+Handle<Value> NodeMagick::fnSaveRenditions( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    int cbidx = ( argc > 1 && !argv[1]->IsFunction() ) ? 2 : 1;
+    bool callback = false;
+    int placeholder = 0;
+    Rendition_t *list = NULL;
+    unsigned int nlist = 0;
+    
+    if( cbidx == 2 && IsDefined( argv[1] ) )
+    {
+        if( !argv[1]->IsObject() ){
+            cbidx = -1;
+        }
+        else {
+            placeholder = argv[1]->ToObject()->Get( String::NewSymbol("placeholder") )->BooleanValue();
+        }
+    }
+    if( argc < 1 || cbidx < 0 || 
+        ( argc > cbidx && !( callback = argv[cbidx]->IsFunction() ) ) ||
+        parseRenditions( ctx, argv[0], &list, &nlist ) != 0 ){
+        retval = ThrowException( Exception::TypeError( String::New( "saveRenditions( [{ width:Number, height:Number, [quality:Number], [filter:String], [thumbnail:Boolean], [format:String], [path:String] }, ...], [{ placeholder:Boolean }], [callback:Function] )" ) ) );
+    }
+    else if( callback )
+    {
+        Baton_t *baton = newBaton( ctx, ASYNC_TASK_RENDITIONS, argv[cbidx] );
+        
+        baton->renditions = list;
+        baton->nrenditions = nlist;
+        baton->eopts.placeholder = placeholder;
+        retval = queueBaton( baton );
+    }
+    else
+    {
+        char *errstr;
+        
+        pthread_mutex_lock( &ctx->lock );
+        ctx->beginStats();
+        errstr = ctx->renderImages( list, nlist, placeholder );
+        ctx->endStats( errstr != NULL );
+        ctx->lastStats = ctx->jstats;
+        ctx->lastPh = ctx->jph;
+        ctx->trackMemory();
+        pthread_mutex_unlock( &ctx->lock );
+        ctx->reportMemory();
+        // failed
+        if( errstr ){
+            retval = ThrowException( Exception::Error( String::New( errstr ) ) );
+            free( errstr );
+        }
+        else {
+            retval = renditionsToArray( list, nlist );
+        }
+        freeRenditions( list, nlist );
+    }
+    
+    return scope.Close( retval );
+}
+
+int NodeMagick::parseBatch( Local<Value> val, Batch_t *batch )
+{
+    Local<Array> arr;
+    Local<Array> sources;
+    BatchItem_t *items;
+    uint32_t len, i;
+    
+    if( !val->IsArray() || !( len = Local<Array>::Cast( val )->Length() ) ){
+        return -1;
+    }
+    else if( !( items = (BatchItem_t*)calloc( len, sizeof( BatchItem_t ) ) ) ){
+        return -1;
+    }
+    batch->items = items;
+    batch->nitems = len;
+    
+    arr = Local<Array>::Cast( val );
+    sources = Array::New( len );
+    for( i = 0; i < len; i++ )
+    {
+        Local<Value> item = arr->Get( i );
+        Local<Object> spec;
+        Local<Value> v;
+        
+        if( !item->IsObject() ){
+            return -1;
+        }
+        spec = item->ToObject();
+        
+        v = spec->Get( String::NewSymbol("src") );
+        if( Buffer::HasInstance( v ) ){
+            Local<Object> buf = v->ToObject();
+            
+            sources->Set( i, buf );
+            items[i].data = Buffer::Data( buf );
+            items[i].len = Buffer::Length( buf );
+        }
+        else if( v->IsString() && v->ToString()->Length() ){
+            items[i].path = strdup( *String::Utf8Value( v ) );
+        }
+        else {
+            return -1;
+        }
+        v = spec->Get( String::NewSymbol("dst") );
+        if( v->IsString() && v->ToString()->Length() ){
+            items[i].dst = strdup( *String::Utf8Value( v ) );
+        }
+        v = spec->Get( String::NewSymbol("width") );
+        items[i].w = ( v->IsNumber() ) ? v->Uint32Value() : 0;
+        v = spec->Get( String::NewSymbol("height") );
+        items[i].h = ( v->IsNumber() ) ? v->Uint32Value() : 0;
+        v = spec->Get( String::NewSymbol("crop") );
+        if( IsDefined( v ) && ( items[i].aspect = v->NumberValue() ) <= 0 ){
+            return -1;
+        }
+        v = spec->Get( String::NewSymbol("align") );
+        items[i].align = ( v->IsNumber() ) ? v->Uint32Value() : ALIGN_CENTER;
+        v = spec->Get( String::NewSymbol("quality") );
+        items[i].quality = ( v->IsNumber() ) ? v->Uint32Value() : 100;
+        if( items[i].quality > 100 ){
+            items[i].quality = 100;
+        }
+        v = spec->Get( String::NewSymbol("thumbnail") );
+        items[i].thumbnail = v->BooleanValue();
+        items[i].filter = UndefinedFilter;
+        v = spec->Get( String::NewSymbol("filter") );
+        if( IsDefined( v ) && filterByName( *String::Utf8Value( v ), &items[i].filter ) != 0 ){
+            return -1;
+        }
+        v = spec->Get( String::NewSymbol("format") );
+        if( v->IsString() && v->ToString()->Length() ){
+            items[i].format = strdup( *String::Utf8Value( v ) );
+        }
+    }
+    batch->sources = Persistent<Array>::New( sources );
+    
+    return 0;
+}
+
+void NodeMagick::freeBatch( Batch_t *batch )
+{
+    unsigned int i;
+    
+    for( i = 0; batch->items && i < batch->nitems; i++ )
+    {
+        BatchItem_t *item = &batch->items[i];
+        
+        if( item->path ){
+            free( item->path );
+        }
+        if( item->dst ){
+            free( item->dst );
+        }
+        if( item->format ){
+            free( item->format );
+        }
+        if( item->errstr ){
+            free( item->errstr );
+        }
+        if( item->blob ){
+            MagickRelinquishMemory( item->blob );
+        }
+    }
+    if( batch->items ){
+        free( batch->items );
+    }
+    if( batch->finished ){
+        free( batch->finished );
+    }
+    if( !batch->sources.IsEmpty() ){
+        batch->sources.Dispose();
+    }
+    if( !batch->progress.IsEmpty() ){
+        batch->progress.Dispose();
+    }
+    if( !batch->callback.IsEmpty() ){
+        batch->callback.Dispose();
+    }
+    pthread_mutex_destroy( &batch->lock );
+    delete batch;
+}
+
+// worker thread: claim items until none is left
+void NodeMagick::runBatch( Batch_t *batch )
+{
+    JobStats_t js;
+    double start;
+    unsigned int idx;
+    int notify;
+    
+    while( 1 )
+    {
+        pthread_mutex_lock( &batch->lock );
+        idx = batch->next;
+        if( idx < batch->nitems ){
+            batch->next++;
+        }
+        pthread_mutex_unlock( &batch->lock );
+        if( idx >= batch->nitems ){
+            break;
+        }
+        
+        memset( &js, 0, sizeof( JobStats_t ) );
+        start = nowMsec();
+        batch->items[idx].errstr = batchItem( &batch->items[idx], &js );
+        js.msec[PHASE_TOTAL] = nowMsec() - start;
+        recordJob( &js, batch->items[idx].errstr != NULL );
+        
+        pthread_mutex_lock( &batch->lock );
+        batch->finished[batch->done++] = idx;
+        if( batch->items[idx].errstr ){
+            batch->failed++;
+        }
+        notify = ( batch->done - batch->reported >= batch->every );
+        pthread_mutex_unlock( &batch->lock );
+        if( notify ){
+            ev_async_send( EV_DEFAULT_UC, &batch->notifier );
+        }
+    }
+}
+
+// plain wand, no instance: pool threads never construct js objects.
+// header is pinged only when a resize can pass a size hint to the decoder
+char *NodeMagick::batchItem( BatchItem_t *item, JobStats_t *js )
+{
+    char *retval = NULL;
+    MagickWand *target;
+    MagickBooleanType status = MagickTrue;
+    unsigned long ow = 0, oh = 0, cw, ch, fw, fh;
+    long x, y;
+    double aspect, t;
+    int multi;
+    
+    if( !( target = acquireWand() ) ){
+        return strdup( strerror(ENOMEM) );
+    }
+    js->bytesIn = ( item->data ) ? item->len : fileSize( item->path );
+    t = nowMsec();
+    if( item->w || item->h )
+    {
+        status = ( item->data ) ? MagickPingImageBlob( target, item->data, item->len ) : 
+                                  MagickPingImage( target, item->path );
+        if( status == MagickTrue )
+        {
+            double ratio;
+            
+            fw = MagickGetImageWidth( target );
+            fh = MagickGetImageHeight( target );
+            aspect = ( item->aspect ) ? item->aspect : (double)fw / (double)fh;
+            cw = ( (double)fw / (double)fh > aspect ) ? fh * aspect : fw;
+            ch = ( (double)fw / (double)fh > aspect ) ? fh : fw / aspect;
+            ow = ( item->w ) ? item->w : item->h * aspect;
+            oh = ( item->h ) ? item->h : item->w / aspect;
+            ow = ( ow ) ? ow : 1;
+            oh = ( oh ) ? oh : 1;
+            ClearMagickWand( target );
+            ratio = fmax( (double)ow / (double)cw, (double)oh / (double)ch );
+            if( ratio < 1.0 )
+            {
+                char hint[64];
+                
+                snprintf( hint, sizeof(hint), "%lux%lu", 
+                          (unsigned long)ceil( fw * ratio ), 
+                          (unsigned long)ceil( fh * ratio ) );
+                MagickSetOption( target, "jpeg:size", hint );
+            }
+        }
+    }
+    if( status == MagickTrue ){
+        status = ( item->data ) ? MagickReadImageBlob( target, item->data, item->len ) : 
+                                  MagickReadImage( target, item->path );
+    }
+    js->msec[PHASE_DECODE] += nowMsec() - t;
+    js->peakPixels = wandBytes( target );
+    if( status == MagickFalse ){
+        WandStrError(target,retval);
+        releaseWand( target );
+        return retval;
+    }
+    
+    // full frames instead of deltas
+    multi = ( MagickGetNumberImages( target ) > 1 );
+    if( multi && ( item->aspect || ow ) )
+    {
+        MagickWand *coalesced;
+        
+        t = nowMsec();
+        if( !( coalesced = MagickCoalesceImages( target ) ) ){
+            WandStrError(target,retval);
+            releaseWand( target );
+            return retval;
+        }
+        releaseWand( target );
+        target = coalesced;
+        js->msec[PHASE_TRANSFORM] += nowMsec() - t;
+    }
+    // crop to the aspect ratio of each decoded frame, resize in one pass
+    MagickResetIterator( target );
+    while( status == MagickTrue && ( item->aspect || ow ) && 
+           MagickNextImage( target ) != MagickFalse )
+    {
+        fw = MagickGetImageWidth( target );
+        fh = MagickGetImageHeight( target );
+        aspect = ( item->aspect ) ? item->aspect : (double)fw / (double)fh;
+        cw = fw;
+        ch = fh;
+        x = y = 0;
+        if( (double)fw / (double)fh > aspect )
+        {
+            cw = fh * aspect;
+            if( item->align == ALIGN_CENTER ){
+                x = ( fw - cw ) / 2;
+            }
+            else if( item->align == ALIGN_RIGHT ){
+                x = fw - cw;
+            }
+        }
+        else if( (double)fw / (double)fh < aspect )
+        {
+            ch = fw / aspect;
+            if( item->align == ALIGN_MIDDLE ){
+                y = ( fh - ch ) / 2;
+            }
+            else if( item->align == ALIGN_BOTTOM ){
+                y = fh - ch;
+            }
+        }
+        t = nowMsec();
+        if( ow && nativeResize( target, x, y, cw, ch, ow, oh, item->filter, item->thumbnail, &status ) ){
+            js->msec[PHASE_RESIZE] += nowMsec() - t;
+            continue;
+        }
+        if( cw != fw || ch != fh ){
+            status = MagickCropImage( target, cw, ch, x, y );
+        }
+        js->msec[PHASE_CROP] += nowMsec() - t;
+        t = nowMsec();
+        if( status == MagickTrue && ow ){
+            status = resizeWand( target, ow, oh, item->filter, item->thumbnail );
+        }
+        if( status == MagickTrue ){
+            status = MagickSetImagePage( target, MagickGetImageWidth( target ), 
+                                         MagickGetImageHeight( target ), 0, 0 );
+        }
+        js->msec[PHASE_RESIZE] += nowMsec() - t;
+        if( wandBytes( target ) > js->peakPixels ){
+            js->peakPixels = wandBytes( target );
+        }
+    }
+    MagickSetFirstIterator( target );
+    
+    if( status == MagickTrue && item->quality ){
+        status = MagickSetImageCompressionQuality( target, item->quality );
+    }
+    if( status == MagickTrue && item->format )
+    {
+        status = MagickSetFormat( target, item->format );
+        // blob encoder looks at the image format
+        if( status == MagickTrue && !item->dst ){
+            status = MagickSetImageFormat( target, item->format );
+        }
+    }
+    if( status == MagickTrue ){
+        t = nowMsec();
+        status = MagickProfileImage( target, "*", NULL, 1 );
+        js->msec[PHASE_PROFILE] += nowMsec() - t;
+    }
+    // animations are written as a whole
+    t = nowMsec();
+    if( status == MagickTrue && item->dst )
+    {
+        status = ( multi ) ? MagickWriteImages( target, item->dst, MagickTrue ) : 
+                             MagickWriteImage( target, item->dst );
+        if( status == MagickTrue ){
+            js->bytesOut = fileSize( item->dst );
+        }
+    }
+    else if( status == MagickTrue )
+    {
+        if( !( item->blob = ( multi ) ? MagickGetImagesBlob( target, &item->outlen ) : 
+                                        MagickGetImageBlob( target, &item->outlen ) ) ){
+            status = MagickFalse;
+        }
+        else {
+            js->bytesOut = item->outlen;
+        }
+    }
+    js->msec[PHASE_ENCODE] += nowMsec() - t;
+    
+    if( status == MagickFalse ){
+        WandStrError(target,retval);
+    }
+    else {
+        item->ow = MagickGetImageWidth( target );
+        item->oh = MagickGetImageHeight( target );
+    }
+    releaseWand( target );
+    
+    return retval;
+}
+Local<Object> NodeMagick::batchItemToObject( BatchItem_t *item, unsigned int idx )
+{
+    Local<Object> obj = Object::New();
+    
+    obj->Set( String::NewSymbol("index"), Number::New( idx ) );
+    if( item->errstr ){
+        obj->Set( String::NewSymbol("error"), String::New( item->errstr ) );
+    }
+    else
+    {
+        obj->Set( String::NewSymbol("width"), Number::New( item->ow ) );
+        obj->Set( String::NewSymbol("height"), Number::New( item->oh ) );
+        if( item->dst ){
+            obj->Set( String::NewSymbol("path"), String::New( item->dst ) );
+        }
+        else if( item->blob ){
+            // hand over encoded image to js without copy
+            obj->Set( String::NewSymbol("buffer"), Local<Object>::New( Buffer::New( (char*)item->blob, item->outlen, freeBlob, NULL )->handle_ ) );
+            item->blob = NULL;
+        }
+    }
+    
+    return obj;
+}
+
+// hand finished items over to js, in chunks to progress() or all at
+// once to the final callback
+void NodeMagick::flushBatch( Batch_t *batch, int final )
+{
+    HandleScope scope;
+    Local<Array> chunk;
+    unsigned int from, to, done, i;
+    
+    if( !final && batch->progress.IsEmpty() ){
+        return;
+    }
+    
+    pthread_mutex_lock( &batch->lock );
+    from = batch->reported;
+    to = done = batch->reported = batch->done;
+    pthread_mutex_unlock( &batch->lock );
+    
+    chunk = Array::New( to - from );
+    for( i = from; i < to; i++ ){
+        chunk->Set( i - from, batchItemToObject( &batch->items[batch->finished[i]], batch->finished[i] ) );
+    }
+    
+    if( to > from && !batch->progress.IsEmpty() )
+    {
+        Local<Value> argv[] = {
+            chunk,
+            Number::New( done ),
+            Number::New( batch->nitems )
+        };
+        TryCatch try_catch;
+        
+        batch->progress->Call( Context::GetCurrent()->Global(), 3, argv );
+        if( try_catch.HasCaught() ){
+            FatalException(try_catch);
+        }
+    }
+    
+    if( final )
+    {
+        Local<Function> cb = Local<Function>::New( batch->callback );
+        Local<Object> summary = Object::New();
+        Handle<Primitive> t = Null();
+        Local<Value> argv[] = {
+            reinterpret_cast<Local<Value>&>(t),
+            summary
+        };
+        
+        summary->Set( String::NewSymbol("total"), Number::New( batch->nitems ) );
+        summary->Set( String::NewSymbol("failed"), Number::New( batch->failed ) );
+        if( batch->progress.IsEmpty() ){
+            summary->Set( String::NewSymbol("results"), chunk );
+        }
+        ev_ref( EV_DEFAULT_UC );
+        ev_async_stop( EV_DEFAULT_UC, &batch->notifier );
+        freeBatch( batch );
+        
+        TryCatch try_catch;
+        cb->Call( Context::GetCurrent()->Global(), 2, argv );
+        if( try_catch.HasCaught() ){
+            FatalException(try_catch);
+        }
+    }
+}
+
+void NodeMagick::onBatchProgress( EV_P_ ev_async *watcher, int )
+{
+    flushBatch( (Batch_t*)watcher->data, 0 );
+}
+
+Handle<Value> NodeMagick::fnBatch( const Arguments &argv )
+{
+    HandleScope scope;
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    Local<Object> opts;
+    Local<Value> v;
+    Batch_t *batch;
+    unsigned int nworkers, i;
+    int priority = 0;
+    
+    if( argc < 2 || !argv[argc-1]->IsFunction() || 
+        ( argc > 2 && !argv[1]->IsObject() ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "batch( [{ src:String|Buffer, [dst:String], [width:Number], [height:Number], [crop:Number], [align:Number], [quality:Number], [filter:String], [thumbnail:Boolean], [format:String] }, ...], [{ [progress:Function], [every:Number], [priority:Number] }], callback:Function )" ) ) );
+        return scope.Close( retval );
+    }
+    
+    batch = new Batch_t();
+    pthread_mutex_init( &batch->lock, NULL );
+    batch->items = NULL;
+    batch->nitems = batch->next = batch->done = batch->failed = batch->reported = 0;
+    batch->workers = 0;
+    batch->every = 64;
+    if( parseBatch( argv[0], batch ) != 0 ||
+        !( batch->finished = (unsigned int*)malloc( sizeof( unsigned int ) * batch->nitems ) ) ){
+        freeBatch( batch );
+        retval = ThrowException( Exception::TypeError( String::New( "batch: invalid job list" ) ) );
+        return scope.Close( retval );
+    }
+    if( argc > 2 )
+    {
+        opts = argv[1]->ToObject();
+        v = opts->Get( String::NewSymbol("progress") );
+        if( v->IsFunction() ){
+            batch->progress = Persistent<Function>::New( Local<Function>::Cast( v ) );
+        }
+        v = opts->Get( String::NewSymbol("every") );
+        if( v->IsNumber() && v->Uint32Value() > 0 ){
+            batch->every = v->Uint32Value();
+        }
+        v = opts->Get( String::NewSymbol("priority") );
+        if( v->IsNumber() ){
+            priority = v->Int32Value();
+            priority = ( priority < JOB_PRI_MIN ) ? JOB_PRI_MIN : 
+                       ( priority > JOB_PRI_MAX ) ? JOB_PRI_MAX : priority;
+        }
+    }
+    
+    // one baton per worker thread, each pulls items until the list is
+    // drained
+    pthread_mutex_lock( &pool.lock );
+    nworkers = ( pool.nthreads < batch->nitems ) ? pool.nthreads : batch->nitems;
+    if( pool.maxqueue && pool.queued + nworkers > pool.maxqueue ){
+        nworkers = ( pool.queued < pool.maxqueue ) ? pool.maxqueue - pool.queued : 0;
+    }
+    if( !nworkers ){
+        pool.rejected++;
+    }
+    pthread_mutex_unlock( &pool.lock );
+    if( !nworkers )
+    {
+        Local<Value> err = Exception::Error( String::New( "job queue is full" ) );
+        
+        freeBatch( batch );
+        err->ToObject()->Set( String::NewSymbol("code"), String::NewSymbol("EAGAIN") );
+        retval = ThrowException( err );
+        return scope.Close( retval );
+    }
+    
+    batch->callback = Persistent<Function>::New( Local<Function>::Cast( argv[argc-1] ) );
+    ev_async_init( &batch->notifier, onBatchProgress );
+    batch->notifier.data = batch;
+    ev_async_start( EV_DEFAULT_UC, &batch->notifier );
+    // workers keep the loop alive
+    ev_unref( EV_DEFAULT_UC );
+    
+    for( i = 0; i < nworkers; i++ )
+    {
+        Baton_t *baton = newBaton( NULL, ASYNC_TASK_BATCH, argv[argc-1] );
+        
+        baton->batch = batch;
+        baton->priority = priority;
+        batch->workers++;
+        retval = queueBaton( baton );
+    }
+    
+    return scope.Close( retval );
+}
+
+int NodeMagick::parsePixelMap( Local<Value> val, char *map, size_t len )
+{
+    String::Utf8Value str( val );
+    size_t n = str.length();
+    
+    // channels accepted by MagickExportImagePixels
+    if( !val->IsString() || !n || n >= len || strspn( *str, "RGBAOCMYKIP" ) != n ){
+        return -1;
+    }
+    memcpy( map, *str, n + 1 );
+    
+    return 0;
+}
+
+int NodeMagick::parsePixelStorage( Local<Value> val, int *storage )
+{
+    int i;
+    
+    if( IsDefined( val ) )
+    {
+        String::Utf8Value name( val );
+        
+        for( i = 0; PIXEL_STORAGE[i].name; i++ )
+        {
+            if( strcmp( PIXEL_STORAGE[i].name, *name ) == 0 ){
+                *storage = i;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    *storage = 0;
+    
+    return 0;
+}
+
+void NodeMagick::freePixels( char *data, void * )
+{
+    free( data );
+}
+
+Local<Object> NodeMagick::pixelsInfo( unsigned long w, unsigned long h, const char *map, int storage )
+{
+    Local<Object> info = Object::New();
+    
+    info->Set( String::NewSymbol("width"), Number::New( w ) );
+    info->Set( String::NewSymbol("height"), Number::New( h ) );
+    info->Set( String::NewSymbol("map"), String::New( map ) );
+    info->Set( String::NewSymbol("storage"), String::New( PIXEL_STORAGE[storage].name ) );
+    
+    return info;
+}
+
+char *NodeMagick::exportPixels( const char *map, int storage, unsigned char **data, size_t *len, 
+                                unsigned long *w, unsigned long *h )
+{
+    char *retval = NULL;
+    double ratio = 1.0;
+    double t;
+    
+    if( !attached ){
+        return strdup( "image not loaded" );
+    }
+    else if( deferred )
+    {
+        ratio = decodeRatio( 0, 0 );
+        if( ( retval = decodeImage( &ratio ) ) ){
+            return retval;
+        }
+    }
+    if( ( retval = applyOps( wand, ratio, &jstats ) ) ){
+        return retval;
+    }
+    
+    t = nowMsec();
+    *w = MagickGetImageWidth( wand );
+    *h = MagickGetImageHeight( wand );
+    *len = *w * *h * strlen( map ) * PIXEL_STORAGE[storage].size;
+    if( !( *data = (unsigned char*)malloc( *len ) ) ){
+        return strdup( strerror(ENOMEM) );
+    }
+    else if( MagickExportImagePixels( wand, 0, 0, *w, *h, map, 
+                                      PIXEL_STORAGE[storage].type, *data ) == MagickFalse ){
+        free( *data );
+        *data = NULL;
+        WandStrError(wand,retval);
+    }
+    else {
+        jstats.bytesOut += *len;
+    }
+    jstats.msec[PHASE_ENCODE] += nowMsec() - t;
+    
+    return retval;
+}
+
+// replace the image by raw pixels
+char *NodeMagick::importPixels( const void *data, size_t len, unsigned long w, unsigned long h, 
+                                const char *map, int storage )
+{
+    char *retval = NULL;
+    double t = nowMsec();
+    
+    if( len < w * h * strlen( map ) * PIXEL_STORAGE[storage].size ){
+        return strdup( "pixel buffer is too short" );
+    }
+    else if( !wand && !( wand = acquireWand() ) ){
+        return strdup( strerror(ENOMEM) );
+    }
+    else if( attached ){
+        ClearMagickWand( wand );
+        disposeImage();
+    }
+    armMonitor( wand );
+    
+    jstats.bytesIn = len;
+    if( MagickConstituteImage( wand, w, h, map, PIXEL_STORAGE[storage].type, data ) == MagickFalse ){
+        WandStrError(wand,retval);
+    }
+    else
+    {
+        attached = 1;
+        lazy = 0;
+        hashed = 0;
+        srcId = 0;
+        maxframes = framestep = 0;
+        orientation = UndefinedOrientation;
+        size.w = cur.w = w;
+        size.h = cur.h = h;
+        size.aspect = cur.aspect = (double)w/(double)h;
+        nops = 0;
+    }
+    jstats.msec[PHASE_DECODE] += nowMsec() - t;
+    notePeak( wandBytes( wand ) );
+    
+    return retval;
+}
+
+Handle<Value> NodeMagick::fnGetPixels( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    int cbidx = ( argc > 0 && !argv[0]->IsFunction() ) ? 1 : 0;
+    bool callback = false;
+    char map[8] = "RGB";
+    int storage = 0;
+    
+    if( cbidx == 1 && argv[0]->IsObject() )
+    {
+        Local<Object> opts = argv[0]->ToObject();
+        Local<Value> v = opts->Get( String::NewSymbol("map") );
+        
+        if( ( IsDefined( v ) && parsePixelMap( v, map, sizeof( map ) ) != 0 ) || 
+            parsePixelStorage( opts->Get( String::NewSymbol("storage") ), &storage ) != 0 ){
+            cbidx = -1;
+        }
+    }
+    else if( cbidx == 1 && IsDefined( argv[0] ) ){
+        cbidx = -1;
+    }
+    
+    if( cbidx == -1 || ( argc > cbidx && !( callback = argv[cbidx]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "getPixels( [{ map:String, storage:'uint8'|'uint16'|'float'|'double' }], [callback:Function] )" ) ) );
+    }
+    else if( callback )
+    {
+        Baton_t *baton = newBaton( ctx, ASYNC_TASK_GETPIXELS, argv[cbidx] );
+        
+        strcpy( baton->pixmap, map );
+        baton->storage = storage;
+        retval = queueBaton( baton );
+    }
+    else
+    {
+        unsigned char *data = NULL;
+        size_t len = 0;
+        unsigned long w = 0, h = 0;
+        char *errstr;
+        
+        pthread_mutex_lock( &ctx->lock );
+        ctx->beginStats();
+        errstr = ctx->exportPixels( map, storage, &data, &len, &w, &h );
+        ctx->endStats( errstr != NULL );
+        ctx->lastStats = ctx->jstats;
+        ctx->trackMemory();
+        pthread_mutex_unlock( &ctx->lock );
+        ctx->reportMemory();
+        // failed
+        if( errstr ){
+            retval = ThrowException( Exception::Error( String::New( errstr ) ) );
+            free( errstr );
+        }
+        else {
+            retval = Buffer::New( (char*)data, len, freePixels, NULL )->handle_;
+        }
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnSetPixels( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    int cbidx = ( argc > 4 && !argv[4]->IsFunction() ) ? 5 : 4;
+    bool callback = false;
+    unsigned int width = 0, height = 0;
+    char map[8];
+    int storage = 0;
+    
+    if( argc < 4 || !Buffer::HasInstance( argv[0] ) || 
+        !argv[1]->IsNumber() || ( width = argv[1]->Uint32Value() ) < 1 ||
+        !argv[2]->IsNumber() || ( height = argv[2]->Uint32Value() ) < 1 ||
+        parsePixelMap( argv[3], map, sizeof( map ) ) != 0 ||
+        ( cbidx == 5 && parsePixelStorage( argv[4], &storage ) != 0 ) ||
+        ( argc > cbidx && !( callback = argv[cbidx]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "setPixels( pixels:Buffer, width:Number > 0, height:Number > 0, map:String, [storage:String], [callback:Function] )" ) ) );
+    }
+    else if( callback )
+    {
+        Baton_t *baton = newBaton( ctx, ASYNC_TASK_SETPIXELS, argv[cbidx] );
+        
+        // keep pixels alive until the job is done
+        baton->buffer = Persistent<Object>::New( argv[0]->ToObject() );
+        baton->blob = (unsigned char*)Buffer::Data( baton->buffer );
+        baton->len = Buffer::Length( baton->buffer );
+        baton->pw = width;
+        baton->ph = height;
+        strcpy( baton->pixmap, map );
+        baton->storage = storage;
+        retval = queueBaton( baton );
+    }
+    else
+    {
+        Local<Object> buf = argv[0]->ToObject();
+        char *errstr;
+        
+        pthread_mutex_lock( &ctx->lock );
+        ctx->beginStats();
+        errstr = ctx->importPixels( Buffer::Data( buf ), Buffer::Length( buf ), width, height, map, storage );
+        // previous source is not needed anymore
+        if( !errstr && !ctx->source.IsEmpty() ){
+            ctx->source.Dispose();
+            ctx->source.Clear();
+        }
+        ctx->endStats( errstr != NULL );
+        ctx->lastStats = ctx->jstats;
+        ctx->trackMemory();
+        pthread_mutex_unlock( &ctx->lock );
+        ctx->reportMemory();
+        // failed
+        if( errstr ){
+            retval = ThrowException( Exception::Error( String::New( errstr ) ) );
+            free( errstr );
+        }
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnDispose( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    
+    // jobs of this instance are queued or running: dispose after them
+    // on the pool instead of waiting for the lock on the loop
+    if( ctx->pending )
+    {
+        Baton_t *baton = newBaton( ctx, ASYNC_TASK_DISPOSE, Local<Value>::New( Undefined() ) );
+        
+        baton->deadline = 0;
+        queueBaton( baton );
+    }
+    else
+    {
+        pthread_mutex_lock( &ctx->lock );
+        ctx->disposeWand();
+        pthread_mutex_unlock( &ctx->lock );
+        ctx->reportMemory();
+        if( !ctx->source.IsEmpty() ){
+            ctx->source.Dispose();
+            ctx->source.Clear();
+        }
+    }
+    
+    return scope.Close( Undefined() );
+}
+
+Handle<Value> NodeMagick::fnSave( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    int cbidx = ( argc > 1 && !argv[1]->IsFunction() ) ? 2 : 1;
+    bool callback = false;
+    EncodeOpts_t opts;
+    
+    if( argc < 1 || 
+        !argv[0]->IsString() || !argv[0]->ToString()->Length() ||
+        parseEncodeOpts( ( cbidx == 2 ) ? argv[1] : Local<Value>::New( Undefined() ), &opts ) != 0 ||
+        ( argc > cbidx && !( callback = argv[cbidx]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "save( path_to_file:String, [options:Object], [callback:Function] )" ) ) );
+    }
+    else if( callback )
+    {
+        retval = ctx->queueFlight( ASYNC_TASK_SAVE, *String::Utf8Value( argv[0] ), &opts, argv[cbidx] );
+    }
+    else {
+        const char *path = strdup( *String::Utf8Value( argv[0] ) );
+        char *errstr;
+        
+        pthread_mutex_lock( &ctx->lock );
+        ctx->beginStats();
+        errstr = ctx->saveImage( path, NULL, NULL, &opts );
+        ctx->endStats( errstr != NULL );
+        ctx->lastStats = ctx->jstats;
+        ctx->lastPh = ctx->jph;
+        ctx->trackMemory();
+        pthread_mutex_unlock( &ctx->lock );
+        ctx->reportMemory();
+        free((void*)path);
+        // failed
+        if( errstr ){
+            retval = ThrowException( Exception::Error( String::New( errstr ) ) );
+            free( errstr );
+        }
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnToBuffer( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    int cbidx = ( argc > 0 && !argv[0]->IsFunction() ) ? 1 : 0;
+    bool callback = false;
+    EncodeOpts_t opts;
+    
+    if( parseEncodeOpts( ( cbidx == 1 ) ? argv[0] : Local<Value>::New( Undefined() ), &opts ) != 0 ||
+        ( argc > cbidx && !( callback = argv[cbidx]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "toBuffer( [options:Object], [callback:Function] )" ) ) );
+    }
+    else if( callback )
+    {
+        retval = ctx->queueFlight( ASYNC_TASK_TOBUFFER, NULL, &opts, argv[cbidx] );
+    }
+    else
+    {
+        unsigned char *blob = NULL;
+        size_t len = 0;
+        char *errstr;
+        
+        pthread_mutex_lock( &ctx->lock );
+        ctx->beginStats();
+        errstr = ctx->saveImage( NULL, &blob, &len, &opts );
+        ctx->endStats( errstr != NULL );
+        ctx->lastStats = ctx->jstats;
+        ctx->lastPh = ctx->jph;
+        ctx->trackMemory();
+        pthread_mutex_unlock( &ctx->lock );
+        ctx->reportMemory();
+        // failed
+        if( errstr ){
+            retval = ThrowException( Exception::Error( String::New( errstr ) ) );
+            free( errstr );
+        }
+        else {
+            retval = Buffer::New( (char*)blob, len, freeBlob, NULL )->handle_;
+        }
+    }
+    
+    return scope.Close( retval );
+}
+
+int NodeMagick::filterByName( const char *name, FilterTypes *filter )
+{
+    int i;
+    
+    for( i = 0; RESIZE_FILTERS[i].name; i++ )
+    {
+        if( strcasecmp( RESIZE_FILTERS[i].name, name ) == 0 ){
+            *filter = RESIZE_FILTERS[i].filter;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+// resample a region of packed 8-bit sRGB pixels outside of the pixel
+// cache. returns 0 if the image or filter does not qualify.
+int NodeMagick::nativeResize( MagickWand *target, long x, long y, unsigned long w, unsigned long h, 
+                              unsigned long ow, unsigned long oh, FilterTypes filter, int thumbnail, 
+                              MagickBooleanType *status )
+{
+    ResampleFilter_e rf;
+    ColorspaceType cs;
+    unsigned char *src, *dst;
+    const char *map;
+    int alpha;
+    
+    switch( filter )
+    {
+        case UndefinedFilter:
+            rf = ( thumbnail ) ? RESAMPLE_LANCZOS : RESAMPLE_POINT;
+        break;
+        case PointFilter:
+            rf = RESAMPLE_POINT;
+        break;
+        case BoxFilter:
+            rf = RESAMPLE_BOX;
+        break;
+        case TriangleFilter:
+            rf = RESAMPLE_TRIANGLE;
+        break;
+        case HermiteFilter:
+            rf = RESAMPLE_HERMITE;
+        break;
+        case CatromFilter:
+            rf = RESAMPLE_CATROM;
+        break;
+        case MitchellFilter:
+            rf = RESAMPLE_MITCHELL;
+        break;
+        case LanczosFilter:
+            rf = RESAMPLE_LANCZOS;
+        break;
+        default:
+            return 0;
+    }
+    cs = MagickGetImageColorspace( target );
+    if( !nativeResample || !w || !h || !ow || !oh || 
+        MagickGetNumberImages( target ) != 1 || 
+        MagickGetImageDepth( target ) != 8 || 
+        // RGBColorspace is linear since 6.7.7
+        cs != sRGBColorspace ){
+        return 0;
+    }
+    
+    // always 4 bytes per pixel, pad opaque images
+    alpha = ( MagickGetImageAlphaChannel( target ) == MagickTrue );
+    map = ( alpha ) ? "RGBA" : "RGBP";
+    if( !( src = (unsigned char*)malloc( w * h * 4 ) ) ){
+        return 0;
+    }
+    else if( !( dst = (unsigned char*)malloc( ow * oh * 4 ) ) ){
+        free( src );
+        return 0;
+    }
+    if( ( *status = MagickExportImagePixels( target, x, y, w, h, map, CharPixel, src ) ) == MagickTrue )
+    {
+        if( alpha ){
+            premultiplyRGBA( src, w * h );
+        }
+        if( resampleRGBA( src, w, h, dst, ow, oh, rf ) != 0 ){
+            free( src );
+            free( dst );
+            return 0;
+        }
+        if( alpha ){
+            unpremultiplyRGBA( dst, ow * oh );
+        }
+        // cheapest way to a canvas of the output size, pixels are
+        // replaced right after
+        if( ( *status = MagickSampleImage( target, ow, oh ) ) == MagickTrue && 
+            ( *status = MagickSetImagePage( target, ow, oh, 0, 0 ) ) == MagickTrue ){
+            *status = MagickImportImagePixels( target, 0, 0, ow, oh, map, CharPixel, dst );
+        }
+        if( *status == MagickTrue && thumbnail ){
+            *status = MagickStripImage( target );
+        }
+    }
+    free( src );
+    free( dst );
+    
+    return 1;
+}
+
+MagickBooleanType NodeMagick::resizeWand( MagickWand *target, unsigned long w, unsigned long h, FilterTypes filter, int thumbnail )
+{
+    MagickBooleanType status = MagickTrue;
+    
+    if( nativeResize( target, 0, 0, MagickGetImageWidth( target ), MagickGetImageHeight( target ), 
+                      w, h, filter, thumbnail, &status ) ){
+        return status;
+    }
+    else if( thumbnail )
+    {
+        unsigned long cw = MagickGetImageWidth( target );
+        unsigned long ch = MagickGetImageHeight( target );
+        
+        // cheap box pre-shrink down to twice the output size, then a
+        // single high quality pass
+        if( cw > w * 4 && ch > h * 4 ){
+            status = MagickResizeImage( target, w * 2, h * 2, BoxFilter, 1.0 );
+        }
+        if( status == MagickTrue ){
+            status = MagickResizeImage( target, w, h, 
+                                        ( filter == UndefinedFilter ) ? LanczosFilter : filter, 
+                                        1.0 );
+        }
+        if( status == MagickTrue ){
+            status = MagickStripImage( target );
+        }
+    }
+    else if( filter == UndefinedFilter ){
+        status = MagickSampleImage( target, w, h );
+    }
+    else {
+        status = MagickResizeImage( target, w, h, filter, 1.0 );
+    }
+    
+    return status;
+}
+
+char *NodeMagick::probeImage( const char *path, const void *blob, size_t len, ProbeInfo_t *info )
+{
+    char *retval = NULL;
+    MagickWand *probe = acquireWand();
+    MagickBooleanType status;
+    
+    if( !probe ){
+        return strdup( strerror(ENOMEM) );
+    }
+    
+    // read header only
+    if( path ){
+        status = MagickPingImage( probe, path );
+    }
+    else {
+        status = MagickPingImageBlob( probe, blob, len );
+    }
+    
+    if( status == MagickFalse ){
+        WandStrError(probe,retval);
+    }
+    else {
+        info->frames = MagickGetNumberImages( probe );
+        MagickSetFirstIterator( probe );
+        info->w = MagickGetImageWidth( probe );
+        info->h = MagickGetImageHeight( probe );
+        info->format = MagickGetImageFormat( probe );
+        info->orientation = MagickGetImageOrientation( probe );
+    }
+    releaseWand( probe );
+    
+    return retval;
+}
+
+Local<Object> NodeMagick::probeToObject( ProbeInfo_t *info )
+{
+    Local<Object> obj = Object::New();
+    
+    obj->Set( String::NewSymbol("width"), Number::New( info->w ) );
+    obj->Set( String::NewSymbol("height"), Number::New( info->h ) );
+    obj->Set( String::NewSymbol("format"), String::New( info->format ? info->format : "" ) );
+    obj->Set( String::NewSymbol("orientation"), Integer::New( info->orientation ) );
+    obj->Set( String::NewSymbol("frames"), Number::New( info->frames ) );
+    
+    return obj;
+}
+
+Handle<Value> NodeMagick::fnProbe( const Arguments &argv )
+{
+    HandleScope scope;
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    bool callback = false;
+    
+    if( argc < 1 || 
+        !( ( argv[0]->IsString() && argv[0]->ToString()->Length() ) || 
+           Buffer::HasInstance( argv[0] ) ) ||
+        ( argc > 1 && !( callback = argv[1]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "probe( path_to_image:String|image:Buffer, [callback:Function] )" ) ) );
+    }
+    else if( callback )
+    {
+        Baton_t *baton = newBaton( NULL, ASYNC_TASK_PROBE, argv[1] );
+        
+        if( Buffer::HasInstance( argv[0] ) ){
+            // keep source buffer alive until the job is done
+            baton->buffer = Persistent<Object>::New( argv[0]->ToObject() );
+            baton->blob = (unsigned char*)Buffer::Data( baton->buffer );
+            baton->len = Buffer::Length( baton->buffer );
+        }
+        else {
+            baton->udata = strdup( *String::Utf8Value( argv[0] ) );
+        }
+        retval = queueBaton( baton );
+    }
+    else
+    {
+        ProbeInfo_t info;
+        char *errstr;
+        
+        memset( &info, 0, sizeof( ProbeInfo_t ) );
+        if( Buffer::HasInstance( argv[0] ) ){
+            Local<Object> buf = argv[0]->ToObject();
+            errstr = probeImage( NULL, Buffer::Data( buf ), Buffer::Length( buf ), &info );
+        }
+        else {
+            errstr = probeImage( *String::Utf8Value( argv[0] ), NULL, 0, &info );
+        }
+        // failed
+        if( errstr ){
+            retval = ThrowException( Exception::Error( String::New( errstr ) ) );
+            free( errstr );
+        }
+        else {
+            retval = probeToObject( &info );
+        }
+        if( info.format ){
+            MagickRelinquishMemory( info.format );
+        }
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::getFormat( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    
+    return scope.Close( String::New( ( ctx->format ) ? ctx->format : "" ) );
+}
+
+void NodeMagick::setFormat( Local<String>, Local<Value> val, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    
+    if( val->IsString() && val->ToString()->Length() ){
+        ctx->format_to = strdup( *String::Utf8Value( val ) );
+    }
+}
+
+Handle<Value> NodeMagick::getRawWidth( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Number::New( ctx->size.w ) );
+}
+Handle<Value> NodeMagick::getRawHeight( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Number::New( ctx->size.h ) );
+}
+
+Handle<Value> NodeMagick::getWidth( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Number::New( ctx->cur.w ) );
+}
+Handle<Value> NodeMagick::getHeight( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Number::New( ctx->cur.h ) );
+}
+
+Handle<Value> NodeMagick::getQuality( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Number::New( ctx->quality ) );
+}
+void NodeMagick::setQuality( Local<String>, Local<Value> val, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    
+    if( val->IsNumber() )
+    {
+        ctx->quality = val->Uint32Value();
+        if( ctx->quality > 100 ){
+            ctx->quality = 100;
+        }
+    }
+}
+
+Handle<Value> NodeMagick::getFilter( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    int i;
+    
+    for( i = 0; RESIZE_FILTERS[i].name; i++ )
+    {
+        if( RESIZE_FILTERS[i].filter == ctx->filter ){
+            break;
+        }
+    }
+    
+    return scope.Close( String::New( RESIZE_FILTERS[i].name ) );
+}
+void NodeMagick::setFilter( Local<String>, Local<Value> val, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    
+    if( !val->IsString() ){
+        ThrowException( Exception::TypeError( String::New( "filter = name:String" ) ) );
+    }
+    // keep the current filter on a typo
+    else if( filterByName( *String::Utf8Value( val ), &ctx->filter ) != 0 ){
+        ThrowException( Exception::Error( String::Concat(
+            String::New( "unknown filter: " ), val->ToString() ) ) );
+    }
+}
+
+Handle<Value> NodeMagick::getThumbnail( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Boolean::New( ctx->thumbnail ) );
+}
+void NodeMagick::setThumbnail( Local<String>, Local<Value> val, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    ctx->thumbnail = val->BooleanValue();
+}
+
+Handle<Value> NodeMagick::getPriority( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Integer::New( ctx->priority ) );
+}
+void NodeMagick::setPriority( Local<String>, Local<Value> val, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    
+    if( val->IsNumber() )
+    {
+        ctx->priority = val->Int32Value();
+        if( ctx->priority < JOB_PRI_MIN ){
+            ctx->priority = JOB_PRI_MIN;
+        }
+        else if( ctx->priority > JOB_PRI_MAX ){
+            ctx->priority = JOB_PRI_MAX;
+        }
+    }
+}
+
+Handle<Value> NodeMagick::getDeadline( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    return scope.Close( Integer::NewFromUnsigned( ctx->deadline ) );
+}
+void NodeMagick::setDeadline( Local<String>, Local<Value> val, const AccessorInfo &info )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
     
-    return retval;
+    if( val->IsNumber() ){
+        ctx->deadline = ( val->NumberValue() > 0 ) ? val->Uint32Value() : 0;
+    }
 }
 
-Handle<Value> NodeMagick::fnLoad( const Arguments& argv )
+Handle<Value> NodeMagick::getMaxConcurrency( Local<String>, const AccessorInfo & )
+{
+    HandleScope scope;
+    return scope.Close( Number::New( pool.nthreads ) );
+}
+void NodeMagick::setMaxConcurrency( Local<String>, Local<Value> val, const AccessorInfo & )
 {
     HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
-    Handle<Value> retval = Undefined();
-    const int argc = argv.Length();
-    bool callback = false;
-
-    if( argc < 1 || 
-        !argv[0]->IsString() || !argv[0]->ToString()->Length() ||
-        ( argc > 1 && !( callback = argv[1]->IsFunction() ) ) ){
-        retval = ThrowException( Exception::TypeError( String::New( "load( path_to_image:String, [callback:Function] )" ) ) );
-    }
-    else if( callback )
-    {
-        Baton_t *baton = new Baton_t();
-        
-        baton->task = ASYNC_TASK_LOAD;
-        baton->ctx = (void*)ctx;
-        baton->retval = Undefined();
-        baton->errstr = NULL;
-        baton->udata = strdup( *String::Utf8Value( argv[0] ) );
-        // detouch from GC
-        baton->callback = Persistent<Function>::New( Local<Function>::Cast( argv[1] ) );
-        ctx->Ref();
-        baton->req = eio_custom( beginEIO, EIO_PRI_DEFAULT, endEIO, baton );
-        ev_ref(EV_DEFAULT_UC);
-    }
-    else
-    {
-        retval = ctx->loadImage( *String::Utf8Value( argv[0] ) );
-        // failed
-        if( IsDefined( retval ) ){
-            retval = ThrowException( Exception::Error( retval->ToString() ) );
-        }
-    }
     
-    return scope.Close( retval );
+    // 0 = one thread per cpu
+    if( val->IsNumber() ){
+        setPoolThreads( val->Uint32Value() );
+    }
 }
 
-Handle<Value> NodeMagick::saveImage( const char *path )
+Handle<Value> NodeMagick::getMaxQueue( Local<String>, const AccessorInfo & )
 {
-    Handle<Value> retval = Undefined();
-    MagickBooleanType status = MagickTrue;
+    HandleScope scope;
+    return scope.Close( Number::New( pool.maxqueue ) );
+}
+void NodeMagick::setMaxQueue( Local<String>, Local<Value> val, const AccessorInfo & )
+{
+    HandleScope scope;
     
-    if( attached )
+    if( val->IsNumber() )
     {
-        // crop
-        if( cropped ){
-            status = MagickCropImage( wand, crop.w, crop.h, x, y );
-        }
-        // resize
-        if( status == MagickTrue && resized ){
-            status = MagickSampleImage( wand, resize.w, resize.h );
-        }
-        // quality 0-100
-        if( status == MagickTrue ){
-            status = MagickSetImageCompressionQuality( wand, quality );
-        }
-        // format
-        if( status == MagickTrue && format_to ){
-            status = MagickSetFormat( wand, format_to );
-        }
-        // remove profiles
-        if( status == MagickTrue ){
-            status = MagickProfileImage( wand, "*", NULL, 1 );
-        }
-        // write
-        if( status == MagickTrue ){
-            status = MagickWriteImage( wand, path );
-        }
-        // failed
-        if( status == MagickFalse ){
-            WandStrError(wand,retval);
-        }
+        pthread_mutex_lock( &pool.lock );
+        // 0 = unlimited
+        pool.maxqueue = val->Uint32Value();
+        pthread_mutex_unlock( &pool.lock );
     }
-    
-    return retval;
 }
 
-Handle<Value> NodeMagick::fnSave( const Arguments &argv )
+Handle<Value> NodeMagick::fnConfigure( const Arguments &argv )
 {
     HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
-    Handle<Value> retval = Undefined();
-    const int argc = argv.Length();
-    bool callback = false;
+    Handle<Value> retval;
+    Local<Object> limits = Object::New();
+    int i;
     
-    if( argc < 1 || 
-        !argv[0]->IsString() || !argv[0]->ToString()->Length() ||
-        ( argc > 1 && !( callback = argv[1]->IsFunction() ) ) ){
-        retval = ThrowException( Exception::TypeError( String::New( "save( path_to_file:String, [callback:Function] )" ) ) );
+    if( argv.Length() > 0 && IsDefined( argv[0] ) && !argv[0]->IsObject() ){
+        return ThrowException( Exception::TypeError( String::New( "configure( [{ memory:Number, map:Number, disk:Number, area:Number, width:Number, height:Number, threads:Number }] )" ) ) );
     }
-    else if( callback )
+    else if( argv.Length() > 0 && argv[0]->IsObject() )
     {
-        Baton_t *baton = new Baton_t();
+        Local<Object> opts = argv[0]->ToObject();
         
-        baton->task = ASYNC_TASK_SAVE;
-        baton->ctx = (void*)ctx;
-        baton->retval = Undefined();
-        baton->errstr = NULL;
-        baton->udata = strdup( *String::Utf8Value( argv[0] ) );
-        // detouch from GC
-        baton->callback = Persistent<Function>::New( Local<Function>::Cast( argv[1] ) );
-        ctx->Ref();
-        baton->req = eio_custom( beginEIO, EIO_PRI_DEFAULT, endEIO, baton );
-        ev_ref(EV_DEFAULT_UC);
-    }
-    else {
-        const char *path = strdup( *String::Utf8Value( argv[0] ) );
-        retval = ctx->saveImage( path );
-        free((void*)path);
-        // failed
-        if( IsDefined( retval ) ){
-            retval = ThrowException( Exception::Error( retval->ToString() ) );
+        for( i = 0; RESOURCE_LIMITS[i].name; i++ )
+        {
+            Local<Value> val = opts->Get( String::NewSymbol( RESOURCE_LIMITS[i].name ) );
+            
+            if( val->IsNumber() && val->NumberValue() >= 0 && 
+                MagickSetResourceLimit( RESOURCE_LIMITS[i].type, 
+                                        (MagickSizeType)val->IntegerValue() ) == MagickFalse ){
+                return ThrowException( Exception::Error( String::Concat( 
+                    String::New( "failed to set resource limit: " ), 
+                    String::New( RESOURCE_LIMITS[i].name ) ) ) );
+            }
         }
     }
     
+    // current limits
+    for( i = 0; RESOURCE_LIMITS[i].name; i++ ){
+        limits->Set( String::NewSymbol( RESOURCE_LIMITS[i].name ), 
+                     Number::New( (double)MagickGetResourceLimit( RESOURCE_LIMITS[i].type ) ) );
+    }
+    retval = limits;
+    
     return scope.Close( retval );
 }
 
-Handle<Value> NodeMagick::getFormat( Local<String>, const AccessorInfo &info )
+Handle<Value> NodeMagick::getMaxPooledWands( Local<String>, const AccessorInfo & )
 {
     HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
-    
-    return scope.Close( String::New( ctx->format ) );
+    return scope.Close( Number::New( wandpool.max ) );
 }
-
-void NodeMagick::setFormat( Local<String>, Local<Value> val, const AccessorInfo &info )
+void NodeMagick::setMaxPooledWands( Local<String>, Local<Value> val, const AccessorInfo & )
 {
     HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
     
-    if( val->IsString() && val->ToString()->Length() ){
-        ctx->format_to = strdup( *String::Utf8Value( val ) );
+    if( val->IsNumber() )
+    {
+        unsigned int max = val->Uint32Value();
+        MagickWand **wands = (MagickWand**)malloc( sizeof( MagickWand* ) * ( max ? max : 1 ) );
+        MagickWand **drop = NULL;
+        unsigned int ndrop = 0;
+        
+        if( wands )
+        {
+            pthread_mutex_lock( &wandpool.lock );
+            // destroy wands beyond new size
+            if( wandpool.count > max ){
+                ndrop = wandpool.count - max;
+                drop = wandpool.wands;
+                wandpool.count = max;
+            }
+            memcpy( wands, wandpool.wands, sizeof( MagickWand* ) * wandpool.count );
+            if( !drop ){
+                free( wandpool.wands );
+            }
+            wandpool.wands = wands;
+            wandpool.max = max;
+            pthread_mutex_unlock( &wandpool.lock );
+            
+            if( drop )
+            {
+                while( ndrop-- ){
+                    DestroyMagickWand( drop[max + ndrop] );
+                }
+                free( drop );
+            }
+        }
     }
 }
 
-Handle<Value> NodeMagick::getRawWidth( Local<String>, const AccessorInfo &info )
-{
-    HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
-    return scope.Close( Number::New( ctx->size.w ) );
-}
-Handle<Value> NodeMagick::getRawHeight( Local<String>, const AccessorInfo &info )
+Local<Object> NodeMagick::jobStatsToObject( JobStats_t *js )
 {
-    HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
-    return scope.Close( Number::New( ctx->size.h ) );
+    Local<Object> obj = Object::New();
+    int i;
+    
+    // milliseconds
+    for( i = 0; i < PHASE_NUM; i++ ){
+        obj->Set( String::NewSymbol( PHASE_NAMES[i] ), Number::New( js->msec[i] ) );
+    }
+    obj->Set( String::NewSymbol("bytesIn"), Number::New( js->bytesIn ) );
+    obj->Set( String::NewSymbol("bytesOut"), Number::New( js->bytesOut ) );
+    obj->Set( String::NewSymbol("peakPixelCache"), Number::New( js->peakPixels ) );
+    
+    return obj;
 }
 
-Handle<Value> NodeMagick::getWidth( Local<String>, const AccessorInfo &info )
-{
-    HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
-    return scope.Close( Number::New( ( ctx->resized ) ? ctx->resize.w : ctx->crop.w ) );
-}
-Handle<Value> NodeMagick::getHeight( Local<String>, const AccessorInfo &info )
+Handle<Value> NodeMagick::getJobStats( Local<String>, const AccessorInfo &info )
 {
     HandleScope scope;
     NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
-    return scope.Close( Number::New( ( ctx->resized ) ? ctx->resize.h : ctx->crop.h ) );
+    return scope.Close( jobStatsToObject( &ctx->lastStats ) );
 }
 
-Handle<Value> NodeMagick::getQuality( Local<String>, const AccessorInfo &info )
+Handle<Value> NodeMagick::getPlaceholder( Local<String>, const AccessorInfo &info )
 {
     HandleScope scope;
     NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
-    return scope.Close( Number::New( ctx->quality ) );
+    
+    if( !ctx->lastPh.valid ){
+        return scope.Close( Null() );
+    }
+    return scope.Close( placeholderToObject( &ctx->lastPh ) );
 }
-void NodeMagick::setQuality( Local<String>, Local<Value> val, const AccessorInfo &info )
+
+Handle<Value> NodeMagick::fnStats( const Arguments & )
 {
     HandleScope scope;
-    NodeMagick *ctx = ObjectUnwrap( NodeMagick, info.This() );
+    Local<Object> obj = Object::New();
+    Local<Object> phases = Object::New();
+    Local<Array> buckets = Array::New( STATS_BUCKETS );
+    int i, j;
     
-    if( val->IsNumber() )
+    // upper bound of each histogram bucket in milliseconds
+    for( i = 0; i < STATS_BUCKETS - 1; i++ ){
+        buckets->Set( i, Number::New( 1 << i ) );
+    }
+    buckets->Set( i, Number::New( INFINITY ) );
+    
+    pthread_mutex_lock( &stats.lock );
+    obj->Set( String::NewSymbol("jobs"), Number::New( stats.jobs ) );
+    obj->Set( String::NewSymbol("errors"), Number::New( stats.errors ) );
+    obj->Set( String::NewSymbol("bytesIn"), Number::New( stats.bytesIn ) );
+    obj->Set( String::NewSymbol("bytesOut"), Number::New( stats.bytesOut ) );
+    for( i = 0; i < PHASE_NUM; i++ )
     {
-        ctx->quality = val->Uint32Value();
-        if( ctx->quality > 100 ){
-            ctx->quality = 100;
+        Local<Object> phase = Object::New();
+        Local<Array> hist = Array::New( STATS_BUCKETS );
+        
+        for( j = 0; j < STATS_BUCKETS; j++ ){
+            hist->Set( j, Number::New( stats.phase[i].hist[j] ) );
         }
+        phase->Set( String::NewSymbol("count"), Number::New( stats.phase[i].count ) );
+        phase->Set( String::NewSymbol("sum"), Number::New( stats.phase[i].sum ) );
+        phase->Set( String::NewSymbol("max"), Number::New( stats.phase[i].max ) );
+        phase->Set( String::NewSymbol("histogram"), hist );
+        phases->Set( String::NewSymbol( PHASE_NAMES[i] ), phase );
+    }
+    pthread_mutex_unlock( &stats.lock );
+    obj->Set( String::NewSymbol("buckets"), buckets );
+    obj->Set( String::NewSymbol("phases"), phases );
+    // icc to sRGB transforms
+    {
+        Local<Object> color = Object::New();
+        double hits, misses;
+        unsigned int entries;
+        
+        colorCacheStats( &hits, &misses, &entries );
+        color->Set( String::NewSymbol("hits"), Number::New( hits ) );
+        color->Set( String::NewSymbol("misses"), Number::New( misses ) );
+        color->Set( String::NewSymbol("entries"), Number::New( entries ) );
+        obj->Set( String::NewSymbol("colorTransforms"), color );
     }
+    
+    return scope.Close( obj );
+}
+
+Handle<Value> NodeMagick::fnPoolStats( const Arguments & )
+{
+    HandleScope scope;
+    Local<Object> stats = Object::New();
+    
+    pthread_mutex_lock( &pool.lock );
+    stats->Set( String::NewSymbol("threads"), Number::New( pool.alive ) );
+    stats->Set( String::NewSymbol("busy"), Number::New( pool.busy ) );
+    stats->Set( String::NewSymbol("helpers"), Number::New( pool.helpers ) );
+    stats->Set( String::NewSymbol("queued"), Number::New( pool.queued ) );
+    stats->Set( String::NewSymbol("peakQueued"), Number::New( pool.peakqueued ) );
+    stats->Set( String::NewSymbol("maxQueue"), Number::New( pool.maxqueue ) );
+    stats->Set( String::NewSymbol("submitted"), Number::New( pool.submitted ) );
+    stats->Set( String::NewSymbol("started"), Number::New( pool.started ) );
+    stats->Set( String::NewSymbol("completed"), Number::New( pool.completed ) );
+    stats->Set( String::NewSymbol("rejected"), Number::New( pool.rejected ) );
+    stats->Set( String::NewSymbol("coalesced"), Number::New( pool.coalesced ) );
+    stats->Set( String::NewSymbol("cancelled"), Number::New( pool.cancelled ) );
+    // milliseconds spent in queue
+    stats->Set( String::NewSymbol("waitAvg"), 
+                Number::New( ( pool.started ) ? pool.waitsum / pool.started : 0 ) );
+    stats->Set( String::NewSymbol("waitMax"), Number::New( pool.waitmax ) );
+    pthread_mutex_unlock( &pool.lock );
+    
+    return scope.Close( stats );
 }
 
 Handle<Value> NodeMagick::fnCrop( const Arguments &argv )
@@ -459,64 +5670,16 @@ Handle<Value> NodeMagick::fnCrop( const Arguments &argv )
     }
     else
     {
-        ctx->cropped = 1;
-        if( ctx->size.aspect > aspect )
-        {
-            ctx->crop.w = ctx->size.h * aspect;
-            ctx->crop.h = ctx->size.h;
-            if( argc > 1 && argv[1]->IsNumber() )
-            {
-                switch( argv[1]->Uint32Value() )
-                {
-                    case ALIGN_LEFT:
-                        ctx->x = 0;
-                    break;
-                    
-                    case ALIGN_CENTER:
-                        ctx->x = ( ctx->size.w - ctx->crop.w ) / 2;
-                    break;
-                    
-                    case ALIGN_RIGHT:
-                        ctx->x = ctx->size.w - ctx->crop.w;
-                    break;
-                    
-                    case ALIGN_NONE:
-                    break;
-                }
-            }
-        }
-        else if( ctx->size.aspect < aspect )
+        switch( ctx->planCrop( aspect, ( argc > 1 && argv[1]->IsNumber() ) ? 
+                                       argv[1]->Uint32Value() : ALIGN_NONE ) )
         {
-            ctx->crop.h = ctx->size.w / aspect;
-            ctx->crop.w = ctx->size.w;
-            if( argc > 1 && argv[1]->IsNumber() )
-            {
-                switch( argv[1]->Uint32Value() )
-                {
-                    case ALIGN_TOP:
-                        ctx->y = 0;
-                    break;
-                    
-                    case ALIGN_MIDDLE:
-                        ctx->y = ( ctx->size.h - ctx->crop.h ) / 2;
-                    break;
-                    
-                    case ALIGN_BOTTOM:
-                        ctx->y = ctx->size.h - ctx->crop.h;
-                    break;
-                    
-                    case ALIGN_NONE:
-                    break;
-                }
-            }
-        }
-        else {
-            ctx->cropped = 0;
-        }
-        
-        if( ctx->cropped ){
-            ctx->crop.aspect = (double)ctx->crop.w/(double)ctx->crop.h;
-            retval = Boolean::New( true );
+            case -1:
+                retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
+            break;
+            
+            case 1:
+                retval = Boolean::New( true );
+            break;
         }
     }
     return scope.Close( retval );
@@ -535,19 +5698,12 @@ Handle<Value> NodeMagick::fnScale( const Arguments &argv )
     }
     else
     {
-        double w = ctx->size.w;
-        double h = ctx->size.h;
+        ImageSize base = ctx->baseSize();
         
-        // if cropped
-        if( ctx->cropped ){
-            w = ctx->crop.w;
-            h = ctx->crop.h;
+        ctx->cur = base;
+        if( ctx->planResize( ( (double)base.w / 100 ) * per, ( (double)base.h / 100 ) * per ) != 0 ){
+            retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
         }
-        
-        ctx->scale = per;
-        ctx->resize.w = ( w / 100 ) * per;
-        ctx->resize.h = ( h / 100 ) * per;
-        ctx->resized = 1;
     }
     
     return scope.Close( retval );
@@ -568,19 +5724,9 @@ Handle<Value> NodeMagick::fnResize( const Arguments &argv )
     }
     else
     {
-        double w = ctx->size.w;
-        double h = ctx->size.h;
-        
-        // if cropped
-        if( ctx->cropped ){
-            w = ctx->crop.w;
-            h = ctx->crop.h;
-        }
-        
-        if( w != width || h != height ){
-            ctx->resize.w = width;
-            ctx->resize.h = height;
-            ctx->resized = 1;
+        ctx->cur = ctx->baseSize();
+        if( ctx->planResize( width, height ) != 0 ){
+            retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
         }
     }
     
@@ -600,21 +5746,11 @@ Handle<Value> NodeMagick::fnResizeByWidth( const Arguments &argv )
     }
     else
     {
-        double w = ctx->size.w;
-        double h = ctx->size.h;
-        double aspect = ctx->size.aspect;
-        
-        // if cropped
-        if( ctx->cropped ){
-            w = ctx->crop.w;
-            h = ctx->crop.h;
-            aspect = ctx->crop.aspect;
-        }
+        ImageSize base = ctx->baseSize();
         
-        if( w != width ){
-            ctx->resize.w = width;
-            ctx->resize.h = width / aspect;
-            ctx->resized = 1;
+        ctx->cur = base;
+        if( ctx->planResize( width, width / base.aspect ) != 0 ){
+            retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
         }
     }
     
@@ -634,22 +5770,154 @@ Handle<Value> NodeMagick::fnResizeByHeight( const Arguments &argv )
     }
     else
     {
-        double w = ctx->size.w;
-        double h = ctx->size.h;
-        double aspect = ctx->size.aspect;
+        ImageSize base = ctx->baseSize();
         
-        // if cropped
-        if( ctx->cropped ){
-            w = ctx->crop.w;
-            h = ctx->crop.h;
-            aspect = ctx->crop.aspect;
+        ctx->cur = base;
+        if( ctx->planResize( height * base.aspect, height ) != 0 ){
+            retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
         }
-        
-        if( h != height ){
-            ctx->resize.w = height * aspect;
-            ctx->resize.h = height;
-            ctx->resized = 1;
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnRotate( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    ImageOp_t *op;
+    
+    if( argc < 1 || !argv[0]->IsNumber() || 
+        ( argc > 1 && !argv[1]->IsString() ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "rotate( degrees:Number, [background:String] )" ) ) );
+    }
+    else if( !( op = ctx->pushOp( OP_ROTATE ) ) ){
+        retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
+    }
+    else
+    {
+        op->arg0 = argv[0]->NumberValue();
+        if( argc > 1 ){
+            snprintf( op->color, sizeof( op->color ), "%s", *String::Utf8Value( argv[1] ) );
+        }
+        rotatedSize( op->arg0, &ctx->cur.w, &ctx->cur.h );
+        ctx->cur.aspect = (double)ctx->cur.w/(double)ctx->cur.h;
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnFlip( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    
+    if( !ctx->pushOp( OP_FLIP ) ){
+        retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnFlop( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    
+    if( !ctx->pushOp( OP_FLOP ) ){
+        retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnAutoOrient( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    ImageOp_t *op;
+    
+    if( ctx->orientation <= TopLeftOrientation ){
+        // nothing to do
+    }
+    else if( !( op = ctx->pushOp( OP_AUTO_ORIENT ) ) ){
+        retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
+    }
+    else
+    {
+        // transposed
+        if( ctx->orientation >= LeftTopOrientation ){
+            op->arg0 = 1;
+            unsigned long w = ctx->cur.w;
+            ctx->cur.w = ctx->cur.h;
+            ctx->cur.h = w;
+            ctx->cur.aspect = (double)ctx->cur.w/(double)ctx->cur.h;
+        }
+        ctx->orientation = TopLeftOrientation;
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnSharpen( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    ImageOp_t *op;
+    
+    if( argc < 2 || !argv[0]->IsNumber() || !argv[1]->IsNumber() || 
+        argv[1]->NumberValue() <= 0 ){
+        retval = ThrowException( Exception::TypeError( String::New( "sharpen( radius:Number, sigma:Number > 0 )" ) ) );
+    }
+    else if( !( op = ctx->pushOp( OP_SHARPEN ) ) ){
+        retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
+    }
+    else {
+        op->arg0 = argv[0]->NumberValue();
+        op->arg1 = argv[1]->NumberValue();
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> NodeMagick::fnExtend( const Arguments &argv )
+{
+    HandleScope scope;
+    NodeMagick *ctx = ObjectUnwrap( NodeMagick, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    unsigned int width,height;
+    ImageOp_t *op;
+    
+    if( argc < 2 || 
+        !argv[0]->IsNumber() || ( width = argv[0]->Uint32Value() ) < 1 ||
+        !argv[1]->IsNumber() || ( height = argv[1]->Uint32Value() ) < 1 ||
+        ( argc > 2 && !argv[2]->IsString() ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "extend( width:Number > 0, height:Number > 0, [background:String] )" ) ) );
+    }
+    else if( !( op = ctx->pushOp( OP_EXTEND ) ) ){
+        retval = ThrowException( Exception::Error( String::New( "too many operations" ) ) );
+    }
+    else
+    {
+        // center image on the new canvas
+        op->w = width;
+        op->h = height;
+        op->x = -( (long)width - (long)ctx->cur.w ) / 2;
+        op->y = -( (long)height - (long)ctx->cur.h ) / 2;
+        if( argc > 2 ){
+            snprintf( op->color, sizeof( op->color ), "%s", *String::Utf8Value( argv[2] ) );
         }
+        ctx->cur.w = width;
+        ctx->cur.h = height;
+        ctx->cur.aspect = (double)width/(double)height;
     }
     
     return scope.Close( retval );
@@ -661,8 +5929,40 @@ void NodeMagick::Initialize( Handle<Object> target )
     HandleScope scope;
     Local<FunctionTemplate> t = FunctionTemplate::New( New );
     
-    pthread_mutex_init( &mutex, NULL );
+    Local<Function> fn;
+    
+    memset( &stats, 0, sizeof( stats ) );
+    pthread_mutex_init( &stats.lock, NULL );
+    memset( &pool, 0, sizeof( pool ) );
+    pthread_mutex_init( &pool.lock, NULL );
+    pthread_cond_init( &pool.cond, NULL );
+    pthread_mutex_init( &pool.donelock, NULL );
+    ev_async_init( &pool.notifier, onJobDone );
+    ev_async_start( EV_DEFAULT_UC, &pool.notifier );
+    // do not keep the loop alive while no job is queued
+    ev_unref( EV_DEFAULT_UC );
     MagickWandGenesis();
+    resampleSelect( NULL );
+    setPoolThreads( 0 );
+    
+    memset( flights, 0, sizeof( flights ) );
+    memset( jobs, 0, sizeof( jobs ) );
+    // handle returned by async load/save/toBuffer/getPixels/setPixels
+    Local<FunctionTemplate> jt = FunctionTemplate::New();
+    jt->SetClassName( String::NewSymbol("NodeMagickJob") );
+    jt->InstanceTemplate()->SetInternalFieldCount( 1 );
+    NODE_SET_PROTOTYPE_METHOD( jt, "cancel", fnCancel );
+    jobTemplate = Persistent<FunctionTemplate>::New( jt );
+    memset( &cache, 0, sizeof( cache ) );
+    pthread_mutex_init( &cache.lock, NULL );
+    
+    memset( &wandpool, 0, sizeof( wandpool ) );
+    pthread_mutex_init( &wandpool.lock, NULL );
+    wandpool.max = 64;
+    wandpool.wands = (MagickWand**)malloc( sizeof( MagickWand* ) * wandpool.max );
+    // PixelPacket holds 4 quantums
+    MagickGetQuantumDepth( &wandpool.pixelsize );
+    wandpool.pixelsize = wandpool.pixelsize / 8 * 4;
     
     t->InstanceTemplate()->SetInternalFieldCount(1);
     t->SetClassName( String::NewSymbol("NodeMagick") );
@@ -672,18 +5972,48 @@ void NodeMagick::Initialize( Handle<Object> target )
     NODE_SET_PROTOTYPE_METHOD( t, "resize", fnResize );
     NODE_SET_PROTOTYPE_METHOD( t, "resizeByWidth", fnResizeByWidth );
     NODE_SET_PROTOTYPE_METHOD( t, "resizeByHeight", fnResizeByHeight );
+    NODE_SET_PROTOTYPE_METHOD( t, "rotate", fnRotate );
+    NODE_SET_PROTOTYPE_METHOD( t, "flip", fnFlip );
+    NODE_SET_PROTOTYPE_METHOD( t, "flop", fnFlop );
+    NODE_SET_PROTOTYPE_METHOD( t, "autoOrient", fnAutoOrient );
+    NODE_SET_PROTOTYPE_METHOD( t, "sharpen", fnSharpen );
+    NODE_SET_PROTOTYPE_METHOD( t, "extend", fnExtend );
     NODE_SET_PROTOTYPE_METHOD( t, "load", fnLoad );
     NODE_SET_PROTOTYPE_METHOD( t, "save", fnSave );
+    NODE_SET_PROTOTYPE_METHOD( t, "toBuffer", fnToBuffer );
+    NODE_SET_PROTOTYPE_METHOD( t, "saveRenditions", fnSaveRenditions );
+    NODE_SET_PROTOTYPE_METHOD( t, "dispose", fnDispose );
+    NODE_SET_PROTOTYPE_METHOD( t, "getPixels", fnGetPixels );
+    NODE_SET_PROTOTYPE_METHOD( t, "setPixels", fnSetPixels );
     
     Local<ObjectTemplate> proto = t->PrototypeTemplate();
     proto->SetAccessor(String::NewSymbol("format"), getFormat, setFormat );
     proto->SetAccessor(String::NewSymbol("quality"), getQuality, setQuality );
+    proto->SetAccessor(String::NewSymbol("filter"), getFilter, setFilter );
+    proto->SetAccessor(String::NewSymbol("thumbnail"), getThumbnail, setThumbnail );
+    proto->SetAccessor(String::NewSymbol("priority"), getPriority, setPriority );
+    proto->SetAccessor(String::NewSymbol("deadline"), getDeadline, setDeadline );
+    proto->SetAccessor(String::NewSymbol("jobStats"), getJobStats );
+    proto->SetAccessor(String::NewSymbol("placeholder"), getPlaceholder );
     proto->SetAccessor(String::NewSymbol("rawWidth"), getRawWidth );
     proto->SetAccessor(String::NewSymbol("rawHeight"), getRawHeight );
     proto->SetAccessor(String::NewSymbol("width"), getWidth );
     proto->SetAccessor(String::NewSymbol("height"), getHeight );
     
-    target->Set( String::NewSymbol("NodeMagick"), t->GetFunction() );
+    fn = t->GetFunction();
+    fn->SetAccessor( String::NewSymbol("maxConcurrency"), getMaxConcurrency, setMaxConcurrency );
+    fn->SetAccessor( String::NewSymbol("maxQueue"), getMaxQueue, setMaxQueue );
+    fn->SetAccessor( String::NewSymbol("maxPooledWands"), getMaxPooledWands, setMaxPooledWands );
+    fn->SetAccessor( String::NewSymbol("resampler"), getResampler, setResampler );
+    // save( { srgb:true } ) converts embedded profiles only with lcms2
+    fn->Set( String::NewSymbol("colorManagement"), Boolean::New( colorAvailable() ) );
+    NODE_SET_METHOD( fn, "probe", fnProbe );
+    NODE_SET_METHOD( fn, "poolStats", fnPoolStats );
+    NODE_SET_METHOD( fn, "configure", fnConfigure );
+    NODE_SET_METHOD( fn, "stats", fnStats );
+    NODE_SET_METHOD( fn, "batch", fnBatch );
+    NODE_SET_METHOD( fn, "cache", fnCache );
+    target->Set( String::NewSymbol("NodeMagick"), fn );
 }
 
 
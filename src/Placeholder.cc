@@ -0,0 +1,181 @@
+/*
+ placeholders for progressive loading
+
+ BlurHash (https://blurha.sh) stores the lowest DCT components of the
+ image in linear light as a base83 string of 20-30 chars that clients
+ decode into a blurred preview. both encoders expect a rendition of a
+ few dozen pixels, the cost is w * h * cx * cy.
+*/
+#include "Placeholder.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static const char BASE83[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+
+static double srgbToLinear( unsigned char v )
+{
+    double c = v / 255.0;
+    return ( c <= 0.04045 ) ? c / 12.92 : pow( ( c + 0.055 ) / 1.055, 2.4 );
+}
+
+static int linearToSrgb( double v )
+{
+    v = ( v < 0 ) ? 0 : ( v > 1 ) ? 1 : v;
+    return ( v <= 0.0031308 ) ? (int)( v * 12.92 * 255 + 0.5 ) :
+                                (int)( ( 1.055 * pow( v, 1 / 2.4 ) - 0.055 ) * 255 + 0.5 );
+}
+
+static double signPow( double v, double e )
+{
+    return copysign( pow( fabs( v ), e ), v );
+}
+
+static char *encode83( unsigned long value, int digits, char *dst )
+{
+    int i;
+
+    for( i = digits - 1; i >= 0; i-- ){
+        dst[i] = BASE83[value % 83];
+        value /= 83;
+    }
+    return dst + digits;
+}
+
+int blurhashEncode( const unsigned char *rgb, unsigned long w, unsigned long h,
+                    int cx, int cy, char *hash, size_t len )
+{
+    double factors[9 * 9][3];
+    double *linear, *cosx, *cosy;
+    double maxac = 0, maxval = 1;
+    unsigned long x, y, npix = w * h;
+    int i, j, k;
+    char *p = hash;
+
+    if( cx < 1 || cx > 9 || cy < 1 || cy > 9 || !w || !h ||
+        len < (size_t)( 2 + 4 + 2 * ( cx * cy - 1 ) + 1 ) ){
+        errno = EINVAL;
+        return -1;
+    }
+    linear = (double*)malloc( sizeof( double ) * npix * 3 );
+    cosx = (double*)malloc( sizeof( double ) * w * cx );
+    cosy = (double*)malloc( sizeof( double ) * h * cy );
+    if( !linear || !cosx || !cosy ){
+        free( linear );
+        free( cosx );
+        free( cosy );
+        errno = ENOMEM;
+        return -1;
+    }
+    for( x = 0; x < npix * 3; x++ ){
+        linear[x] = srgbToLinear( rgb[x] );
+    }
+    // separable basis
+    for( i = 0; i < cx; i++ ){
+        for( x = 0; x < w; x++ ){
+            cosx[i * w + x] = cos( M_PI * i * x / w );
+        }
+    }
+    for( j = 0; j < cy; j++ ){
+        for( y = 0; y < h; y++ ){
+            cosy[j * h + y] = cos( M_PI * j * y / h );
+        }
+    }
+
+    for( j = 0; j < cy; j++ )
+    {
+        for( i = 0; i < cx; i++ )
+        {
+            double *f = factors[j * cx + i];
+            double norm = ( ( i || j ) ? 2.0 : 1.0 ) / npix;
+
+            f[0] = f[1] = f[2] = 0;
+            for( y = 0; y < h; y++ )
+            {
+                const double *row = linear + y * w * 3;
+
+                for( x = 0; x < w; x++ )
+                {
+                    double basis = cosx[i * w + x] * cosy[j * h + y];
+
+                    f[0] += basis * row[x * 3];
+                    f[1] += basis * row[x * 3 + 1];
+                    f[2] += basis * row[x * 3 + 2];
+                }
+            }
+            for( k = 0; k < 3; k++ ){
+                f[k] *= norm;
+                if( ( i || j ) && fabs( f[k] ) > maxac ){
+                    maxac = fabs( f[k] );
+                }
+            }
+        }
+    }
+    free( linear );
+    free( cosx );
+    free( cosy );
+
+    // size flag, quantised maximum of AC, DC, AC
+    p = encode83( ( cx - 1 ) + ( cy - 1 ) * 9, 1, p );
+    if( cx * cy > 1 ){
+        int qmax = (int)fmax( 0, fmin( 82, floor( maxac * 166 - 0.5 ) ) );
+
+        maxval = ( qmax + 1 ) / 166.0;
+        p = encode83( qmax, 1, p );
+    }
+    else {
+        p = encode83( 0, 1, p );
+    }
+    p = encode83( ( linearToSrgb( factors[0][0] ) << 16 ) +
+                  ( linearToSrgb( factors[0][1] ) << 8 ) +
+                  linearToSrgb( factors[0][2] ), 4, p );
+    for( k = 1; k < cx * cy; k++ )
+    {
+        unsigned long q = 0;
+        int c;
+
+        for( c = 0; c < 3; c++ ){
+            q = q * 19 + (unsigned long)fmax( 0, fmin( 18,
+                    floor( signPow( factors[k][c] / maxval, 0.5 ) * 9 + 9.5 ) ) );
+        }
+        p = encode83( q, 2, p );
+    }
+    *p = 0;
+
+    return 0;
+}
+
+void dominantColor( const unsigned char *rgb, unsigned long npix, unsigned char *color )
+{
+    // 4096 buckets of count and channel sums
+    unsigned long count[4096];
+    unsigned long sum[4096][3];
+    unsigned long i;
+    unsigned int b, best = 0;
+
+    memset( count, 0, sizeof( count ) );
+    memset( sum, 0, sizeof( sum ) );
+    for( i = 0; i < npix; i++ )
+    {
+        const unsigned char *px = rgb + i * 3;
+
+        b = ( ( px[0] >> 4 ) << 8 ) | ( ( px[1] >> 4 ) << 4 ) | ( px[2] >> 4 );
+        count[b]++;
+        sum[b][0] += px[0];
+        sum[b][1] += px[1];
+        sum[b][2] += px[2];
+        if( count[b] > count[best] ){
+            best = b;
+        }
+    }
+    if( !count[best] ){
+        color[0] = color[1] = color[2] = 0;
+        return;
+    }
+    for( i = 0; i < 3; i++ ){
+        color[i] = (unsigned char)( ( sum[best][i] + count[best] / 2 ) / count[best] );
+    }
+}
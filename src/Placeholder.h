@@ -0,0 +1,19 @@
+/*
+ placeholders for progressive loading computed from a tiny rendition
+*/
+#ifndef ___PLACEHOLDER_H___
+#define ___PLACEHOLDER_H___
+
+#include <stddef.h>
+
+// BlurHash of w x h packed 8-bit sRGB pixels with cx x cy components
+// (1-9 each) into hash, at most 2 + 4 + 2 * 80 + 1 bytes. returns -1 and
+// sets errno on failure.
+int blurhashEncode( const unsigned char *rgb, unsigned long w, unsigned long h,
+                    int cx, int cy, char *hash, size_t len );
+
+// most frequent colour of npix packed 8-bit RGB pixels, averaged over
+// the pixels of its 4-bit per channel bucket
+void dominantColor( const unsigned char *rgb, unsigned long npix, unsigned char *color );
+
+#endif
@@ -0,0 +1,575 @@
+/*
+ separable resampler for packed 8-bit RGBA pixels
+
+ weights are precomputed per output column and row as 16 bit fixed
+ point, the horizontal pass writes 8-bit rows that the vertical pass
+ combines. SSE2/AVX2 kernels are picked at runtime.
+*/
+#include "Resample.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define RESAMPLE_X86
+#include <immintrin.h>
+#endif
+
+// fixed point weights, 1.0 = 1 << PRECISION_BITS
+#define PRECISION_BITS 14
+
+typedef struct {
+    // first source pixel and number of taps per output pixel
+    unsigned long *bounds;
+    // ksize weights per output pixel
+    short *k;
+    unsigned long ksize;
+} Weights_t;
+
+typedef void (*HorizontalPass_t)( const unsigned char *src, unsigned long sw,
+                                  unsigned char *dst, unsigned long dw,
+                                  unsigned long rows, const Weights_t *wx );
+typedef void (*VerticalPass_t)( const unsigned char *src, unsigned long bytes,
+                                unsigned char *dst, unsigned long dh,
+                                const Weights_t *wy );
+
+// MARK: filters
+static double sinc( double x )
+{
+    if( x == 0.0 ){
+        return 1.0;
+    }
+    x *= M_PI;
+    return sin( x ) / x;
+}
+
+static double filterBox( double x )
+{
+    return ( x > -0.5 && x <= 0.5 ) ? 1.0 : 0.0;
+}
+
+static double filterTriangle( double x )
+{
+    x = fabs( x );
+    return ( x < 1.0 ) ? 1.0 - x : 0.0;
+}
+
+static double filterHermite( double x )
+{
+    x = fabs( x );
+    return ( x < 1.0 ) ? ( 2.0 * x - 3.0 ) * x * x + 1.0 : 0.0;
+}
+
+// Mitchell-Netravali cubic
+static double filterCubic( double x, double b, double c )
+{
+    x = fabs( x );
+    if( x < 1.0 ){
+        return ( ( 12.0 - 9.0 * b - 6.0 * c ) * x * x * x +
+                 ( -18.0 + 12.0 * b + 6.0 * c ) * x * x +
+                 ( 6.0 - 2.0 * b ) ) / 6.0;
+    }
+    else if( x < 2.0 ){
+        return ( ( -b - 6.0 * c ) * x * x * x +
+                 ( 6.0 * b + 30.0 * c ) * x * x +
+                 ( -12.0 * b - 48.0 * c ) * x +
+                 ( 8.0 * b + 24.0 * c ) ) / 6.0;
+    }
+    return 0.0;
+}
+
+static double filterCatrom( double x )
+{
+    return filterCubic( x, 0.0, 0.5 );
+}
+
+static double filterMitchell( double x )
+{
+    return filterCubic( x, 1.0 / 3.0, 1.0 / 3.0 );
+}
+
+static double filterLanczos( double x )
+{
+    return ( x > -3.0 && x < 3.0 ) ? sinc( x ) * sinc( x / 3.0 ) : 0.0;
+}
+
+static const struct {
+    double (*fn)( double x );
+    double support;
+} FILTERS[] = {
+    // RESAMPLE_POINT picks the nearest pixel
+    { NULL, 0.0 },
+    { filterBox, 0.5 },
+    { filterTriangle, 1.0 },
+    { filterHermite, 1.0 },
+    { filterCatrom, 2.0 },
+    { filterMitchell, 2.0 },
+    { filterLanczos, 3.0 }
+};
+
+static inline unsigned char clip8( int v )
+{
+    v >>= PRECISION_BITS;
+    return ( v < 0 ) ? 0 : ( v > 255 ) ? 255 : v;
+}
+
+static void freeWeights( Weights_t *w )
+{
+    free( w->bounds );
+    free( w->k );
+}
+
+static int computeWeights( unsigned long insize, unsigned long outsize,
+                           ResampleFilter_e filter, Weights_t *w )
+{
+    double scale = (double)insize / (double)outsize;
+    double filterscale = ( scale < 1.0 ) ? 1.0 : scale;
+    double support = FILTERS[filter].support * filterscale;
+    double *tmp;
+    unsigned long xx, x;
+
+    w->ksize = ( filter == RESAMPLE_POINT ) ? 1 : (unsigned long)ceil( support ) * 2 + 1;
+    w->bounds = (unsigned long*)malloc( sizeof( unsigned long ) * outsize * 2 );
+    w->k = (short*)calloc( outsize * w->ksize, sizeof( short ) );
+    tmp = (double*)malloc( sizeof( double ) * w->ksize );
+    if( !w->bounds || !w->k || !tmp ){
+        freeWeights( w );
+        free( tmp );
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for( xx = 0; xx < outsize; xx++ )
+    {
+        double center = ( xx + 0.5 ) * scale;
+        double sum = 0.0;
+        long xmin, xmax;
+
+        if( filter == RESAMPLE_POINT ){
+            xmin = ( (unsigned long)center < insize ) ? (long)center : insize - 1;
+            w->bounds[xx * 2] = xmin;
+            w->bounds[xx * 2 + 1] = 1;
+            w->k[xx] = 1 << PRECISION_BITS;
+            continue;
+        }
+
+        xmin = (long)( center - support + 0.5 );
+        if( xmin < 0 ){
+            xmin = 0;
+        }
+        xmax = (long)( center + support + 0.5 );
+        if( xmax > (long)insize ){
+            xmax = insize;
+        }
+        if( xmax - xmin > (long)w->ksize ){
+            xmax = xmin + w->ksize;
+        }
+        for( x = 0; x < (unsigned long)( xmax - xmin ); x++ ){
+            tmp[x] = FILTERS[filter].fn( ( x + xmin - center + 0.5 ) / filterscale );
+            sum += tmp[x];
+        }
+        for( x = 0; x < (unsigned long)( xmax - xmin ); x++ ){
+            double v = ( sum != 0.0 ) ? tmp[x] / sum : 0.0;
+            w->k[xx * w->ksize + x] = (short)floor( v * ( 1 << PRECISION_BITS ) + 0.5 );
+        }
+        w->bounds[xx * 2] = xmin;
+        w->bounds[xx * 2 + 1] = xmax - xmin;
+    }
+    free( tmp );
+
+    return 0;
+}
+
+// MARK: scalar
+static void horizontalScalar( const unsigned char *src, unsigned long sw,
+                              unsigned char *dst, unsigned long dw,
+                              unsigned long rows, const Weights_t *wx )
+{
+    unsigned long y, xx, i;
+
+    for( y = 0; y < rows; y++ )
+    {
+        const unsigned char *srow = src + y * sw * 4;
+        unsigned char *drow = dst + y * dw * 4;
+
+        for( xx = 0; xx < dw; xx++ )
+        {
+            const unsigned char *p = srow + wx->bounds[xx * 2] * 4;
+            const short *k = wx->k + xx * wx->ksize;
+            int acc[4] = {
+                1 << ( PRECISION_BITS - 1 ), 1 << ( PRECISION_BITS - 1 ),
+                1 << ( PRECISION_BITS - 1 ), 1 << ( PRECISION_BITS - 1 )
+            };
+
+            for( i = 0; i < wx->bounds[xx * 2 + 1]; i++, p += 4 ){
+                acc[0] += p[0] * k[i];
+                acc[1] += p[1] * k[i];
+                acc[2] += p[2] * k[i];
+                acc[3] += p[3] * k[i];
+            }
+            drow[xx * 4] = clip8( acc[0] );
+            drow[xx * 4 + 1] = clip8( acc[1] );
+            drow[xx * 4 + 2] = clip8( acc[2] );
+            drow[xx * 4 + 3] = clip8( acc[3] );
+        }
+    }
+}
+
+static void verticalRowScalar( const unsigned char *src, unsigned long bytes,
+                               unsigned char *drow, unsigned long x,
+                               unsigned long ymin, unsigned long count,
+                               const short *k )
+{
+    unsigned long i;
+
+    for( ; x < bytes; x++ )
+    {
+        int acc = 1 << ( PRECISION_BITS - 1 );
+
+        for( i = 0; i < count; i++ ){
+            acc += src[( ymin + i ) * bytes + x] * k[i];
+        }
+        drow[x] = clip8( acc );
+    }
+}
+
+static void verticalScalar( const unsigned char *src, unsigned long bytes,
+                            unsigned char *dst, unsigned long dh,
+                            const Weights_t *wy )
+{
+    unsigned long yy;
+
+    for( yy = 0; yy < dh; yy++ ){
+        verticalRowScalar( src, bytes, dst + yy * bytes, 0, wy->bounds[yy * 2],
+                           wy->bounds[yy * 2 + 1], wy->k + yy * wy->ksize );
+    }
+}
+
+// MARK: x86
+#ifdef RESAMPLE_X86
+
+static inline int load32( const unsigned char *p )
+{
+    int v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+// two 16 bit weights for _mm_madd_epi16
+static inline int pairWeights( short a, short b )
+{
+    return (int)( (unsigned short)a | ( (unsigned int)(unsigned short)b << 16 ) );
+}
+
+__attribute__((target("sse2")))
+static void horizontalSSE2( const unsigned char *src, unsigned long sw,
+                            unsigned char *dst, unsigned long dw,
+                            unsigned long rows, const Weights_t *wx )
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned long y, xx, i;
+
+    for( y = 0; y < rows; y++ )
+    {
+        const unsigned char *srow = src + y * sw * 4;
+        unsigned char *drow = dst + y * dw * 4;
+
+        for( xx = 0; xx < dw; xx++ )
+        {
+            const unsigned char *p = srow + wx->bounds[xx * 2] * 4;
+            const unsigned long count = wx->bounds[xx * 2 + 1];
+            const short *k = wx->k + xx * wx->ksize;
+            __m128i sss = _mm_set1_epi32( 1 << ( PRECISION_BITS - 1 ) );
+            __m128i pix, mmk;
+            int v;
+
+            // two pixels interleaved by channel per madd
+            for( i = 0; i + 1 < count; i += 2 ){
+                pix = _mm_unpacklo_epi8( _mm_cvtsi32_si128( load32( p + i * 4 ) ),
+                                         _mm_cvtsi32_si128( load32( p + i * 4 + 4 ) ) );
+                pix = _mm_unpacklo_epi8( pix, zero );
+                mmk = _mm_set1_epi32( pairWeights( k[i], k[i + 1] ) );
+                sss = _mm_add_epi32( sss, _mm_madd_epi16( pix, mmk ) );
+            }
+            if( i < count ){
+                pix = _mm_unpacklo_epi8( _mm_cvtsi32_si128( load32( p + i * 4 ) ), zero );
+                pix = _mm_unpacklo_epi16( pix, zero );
+                mmk = _mm_set1_epi32( pairWeights( k[i], 0 ) );
+                sss = _mm_add_epi32( sss, _mm_madd_epi16( pix, mmk ) );
+            }
+            sss = _mm_srai_epi32( sss, PRECISION_BITS );
+            sss = _mm_packs_epi32( sss, sss );
+            sss = _mm_packus_epi16( sss, sss );
+            v = _mm_cvtsi128_si32( sss );
+            memcpy( drow + xx * 4, &v, sizeof( v ) );
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static void verticalSSE2( const unsigned char *src, unsigned long bytes,
+                          unsigned char *dst, unsigned long dh,
+                          const Weights_t *wy )
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned long yy, x, i;
+
+    for( yy = 0; yy < dh; yy++ )
+    {
+        const unsigned long ymin = wy->bounds[yy * 2];
+        const unsigned long count = wy->bounds[yy * 2 + 1];
+        const short *k = wy->k + yy * wy->ksize;
+        unsigned char *drow = dst + yy * bytes;
+
+        for( x = 0; x + 16 <= bytes; x += 16 )
+        {
+            __m128i s0 = _mm_set1_epi32( 1 << ( PRECISION_BITS - 1 ) );
+            __m128i s1 = s0, s2 = s0, s3 = s0;
+            __m128i a, b, lo, hi, mmk;
+
+            // two rows interleaved per madd
+            for( i = 0; i + 1 < count; i += 2 ){
+                a = _mm_loadu_si128( (const __m128i*)( src + ( ymin + i ) * bytes + x ) );
+                b = _mm_loadu_si128( (const __m128i*)( src + ( ymin + i + 1 ) * bytes + x ) );
+                mmk = _mm_set1_epi32( pairWeights( k[i], k[i + 1] ) );
+                lo = _mm_unpacklo_epi8( a, b );
+                hi = _mm_unpackhi_epi8( a, b );
+                s0 = _mm_add_epi32( s0, _mm_madd_epi16( _mm_unpacklo_epi8( lo, zero ), mmk ) );
+                s1 = _mm_add_epi32( s1, _mm_madd_epi16( _mm_unpackhi_epi8( lo, zero ), mmk ) );
+                s2 = _mm_add_epi32( s2, _mm_madd_epi16( _mm_unpacklo_epi8( hi, zero ), mmk ) );
+                s3 = _mm_add_epi32( s3, _mm_madd_epi16( _mm_unpackhi_epi8( hi, zero ), mmk ) );
+            }
+            if( i < count ){
+                a = _mm_loadu_si128( (const __m128i*)( src + ( ymin + i ) * bytes + x ) );
+                mmk = _mm_set1_epi32( pairWeights( k[i], 0 ) );
+                lo = _mm_unpacklo_epi8( a, zero );
+                hi = _mm_unpackhi_epi8( a, zero );
+                s0 = _mm_add_epi32( s0, _mm_madd_epi16( _mm_unpacklo_epi16( lo, zero ), mmk ) );
+                s1 = _mm_add_epi32( s1, _mm_madd_epi16( _mm_unpackhi_epi16( lo, zero ), mmk ) );
+                s2 = _mm_add_epi32( s2, _mm_madd_epi16( _mm_unpacklo_epi16( hi, zero ), mmk ) );
+                s3 = _mm_add_epi32( s3, _mm_madd_epi16( _mm_unpackhi_epi16( hi, zero ), mmk ) );
+            }
+            s0 = _mm_packs_epi32( _mm_srai_epi32( s0, PRECISION_BITS ),
+                                  _mm_srai_epi32( s1, PRECISION_BITS ) );
+            s2 = _mm_packs_epi32( _mm_srai_epi32( s2, PRECISION_BITS ),
+                                  _mm_srai_epi32( s3, PRECISION_BITS ) );
+            _mm_storeu_si128( (__m128i*)( drow + x ), _mm_packus_epi16( s0, s2 ) );
+        }
+        verticalRowScalar( src, bytes, drow, x, ymin, count, k );
+    }
+}
+
+// unpack/pack work per 128 bit lane, so lanes come out in order
+__attribute__((target("avx2")))
+static void verticalAVX2( const unsigned char *src, unsigned long bytes,
+                          unsigned char *dst, unsigned long dh,
+                          const Weights_t *wy )
+{
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned long yy, x, i;
+
+    for( yy = 0; yy < dh; yy++ )
+    {
+        const unsigned long ymin = wy->bounds[yy * 2];
+        const unsigned long count = wy->bounds[yy * 2 + 1];
+        const short *k = wy->k + yy * wy->ksize;
+        unsigned char *drow = dst + yy * bytes;
+
+        for( x = 0; x + 32 <= bytes; x += 32 )
+        {
+            __m256i s0 = _mm256_set1_epi32( 1 << ( PRECISION_BITS - 1 ) );
+            __m256i s1 = s0, s2 = s0, s3 = s0;
+            __m256i a, b, lo, hi, mmk;
+
+            for( i = 0; i + 1 < count; i += 2 ){
+                a = _mm256_loadu_si256( (const __m256i*)( src + ( ymin + i ) * bytes + x ) );
+                b = _mm256_loadu_si256( (const __m256i*)( src + ( ymin + i + 1 ) * bytes + x ) );
+                mmk = _mm256_set1_epi32( pairWeights( k[i], k[i + 1] ) );
+                lo = _mm256_unpacklo_epi8( a, b );
+                hi = _mm256_unpackhi_epi8( a, b );
+                s0 = _mm256_add_epi32( s0, _mm256_madd_epi16( _mm256_unpacklo_epi8( lo, zero ), mmk ) );
+                s1 = _mm256_add_epi32( s1, _mm256_madd_epi16( _mm256_unpackhi_epi8( lo, zero ), mmk ) );
+                s2 = _mm256_add_epi32( s2, _mm256_madd_epi16( _mm256_unpacklo_epi8( hi, zero ), mmk ) );
+                s3 = _mm256_add_epi32( s3, _mm256_madd_epi16( _mm256_unpackhi_epi8( hi, zero ), mmk ) );
+            }
+            if( i < count ){
+                a = _mm256_loadu_si256( (const __m256i*)( src + ( ymin + i ) * bytes + x ) );
+                mmk = _mm256_set1_epi32( pairWeights( k[i], 0 ) );
+                lo = _mm256_unpacklo_epi8( a, zero );
+                hi = _mm256_unpackhi_epi8( a, zero );
+                s0 = _mm256_add_epi32( s0, _mm256_madd_epi16( _mm256_unpacklo_epi16( lo, zero ), mmk ) );
+                s1 = _mm256_add_epi32( s1, _mm256_madd_epi16( _mm256_unpackhi_epi16( lo, zero ), mmk ) );
+                s2 = _mm256_add_epi32( s2, _mm256_madd_epi16( _mm256_unpacklo_epi16( hi, zero ), mmk ) );
+                s3 = _mm256_add_epi32( s3, _mm256_madd_epi16( _mm256_unpackhi_epi16( hi, zero ), mmk ) );
+            }
+            s0 = _mm256_packs_epi32( _mm256_srai_epi32( s0, PRECISION_BITS ),
+                                     _mm256_srai_epi32( s1, PRECISION_BITS ) );
+            s2 = _mm256_packs_epi32( _mm256_srai_epi32( s2, PRECISION_BITS ),
+                                     _mm256_srai_epi32( s3, PRECISION_BITS ) );
+            _mm256_storeu_si256( (__m256i*)( drow + x ), _mm256_packus_epi16( s0, s2 ) );
+        }
+        verticalRowScalar( src, bytes, drow, x, ymin, count, k );
+    }
+}
+
+static int hasSSE2( void )
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "sse2" );
+}
+
+static int hasAVX2( void )
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" );
+}
+
+#endif
+
+static int hasScalar( void )
+{
+    return 1;
+}
+
+// best first
+static const struct {
+    const char *name;
+    int (*supported)( void );
+    HorizontalPass_t horizontal;
+    VerticalPass_t vertical;
+} KERNELS[] = {
+#ifdef RESAMPLE_X86
+    { "avx2", hasAVX2, horizontalSSE2, verticalAVX2 },
+    { "sse2", hasSSE2, horizontalSSE2, verticalSSE2 },
+#endif
+    { "scalar", hasScalar, horizontalScalar, verticalScalar },
+    { NULL, NULL, NULL, NULL }
+};
+
+// set by resampleSelect while workers resample, accessed atomically
+static int kernel = -1;
+
+static int findKernel( const char *name )
+{
+    int i;
+
+    for( i = 0; KERNELS[i].name; i++ )
+    {
+        if( ( !name || strcmp( name, KERNELS[i].name ) == 0 ) &&
+            KERNELS[i].supported() ){
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// selected kernel, the best one until a kernel is selected
+static int currentKernel( void )
+{
+    int k = __atomic_load_n( &kernel, __ATOMIC_ACQUIRE );
+
+    return ( k < 0 ) ? findKernel( NULL ) : k;
+}
+
+int resampleSelect( const char *name )
+{
+    int k = findKernel( name );
+
+    if( k < 0 ){
+        return -1;
+    }
+    __atomic_store_n( &kernel, k, __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+const char *resampleKernel( void )
+{
+    return KERNELS[currentKernel()].name;
+}
+
+int resampleRGBA( const unsigned char *src, unsigned long sw, unsigned long sh,
+                  unsigned char *dst, unsigned long dw, unsigned long dh,
+                  ResampleFilter_e filter )
+{
+    Weights_t wx, wy;
+    unsigned char *tmp = NULL;
+    // one kernel for both passes
+    int k = currentKernel();
+
+    if( !sw || !sh || !dw || !dh ){
+        errno = EINVAL;
+        return -1;
+    }
+
+    // same width: vertical pass reads the source
+    if( sw != dw )
+    {
+        if( computeWeights( sw, dw, filter, &wx ) != 0 ){
+            return -1;
+        }
+        else if( !( tmp = (unsigned char*)malloc( dw * sh * 4 ) ) ){
+            freeWeights( &wx );
+            errno = ENOMEM;
+            return -1;
+        }
+        KERNELS[k].horizontal( src, sw, ( sh == dh ) ? dst : tmp, dw, sh, &wx );
+        freeWeights( &wx );
+        src = tmp;
+    }
+    if( sh != dh )
+    {
+        if( computeWeights( sh, dh, filter, &wy ) != 0 ){
+            free( tmp );
+            return -1;
+        }
+        KERNELS[k].vertical( src, dw * 4, dst, dh, &wy );
+        freeWeights( &wy );
+    }
+    else if( sw == dw ){
+        memcpy( dst, src, dw * dh * 4 );
+    }
+    free( tmp );
+
+    return 0;
+}
+
+void premultiplyRGBA( unsigned char *pixels, unsigned long npix )
+{
+    unsigned long i;
+
+    for( i = 0; i < npix; i++, pixels += 4 )
+    {
+        unsigned int a = pixels[3];
+
+        if( a != 255 ){
+            pixels[0] = ( pixels[0] * a + 127 ) / 255;
+            pixels[1] = ( pixels[1] * a + 127 ) / 255;
+            pixels[2] = ( pixels[2] * a + 127 ) / 255;
+        }
+    }
+}
+
+void unpremultiplyRGBA( unsigned char *pixels, unsigned long npix )
+{
+    unsigned long i, c;
+
+    for( i = 0; i < npix; i++, pixels += 4 )
+    {
+        unsigned int a = pixels[3];
+
+        if( !a ){
+            pixels[0] = pixels[1] = pixels[2] = 0;
+        }
+        else if( a != 255 )
+        {
+            for( c = 0; c < 3; c++ ){
+                unsigned int v = ( pixels[c] * 255 + a / 2 ) / a;
+                pixels[c] = ( v > 255 ) ? 255 : v;
+            }
+        }
+    }
+}
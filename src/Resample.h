@@ -0,0 +1,33 @@
+/*
+ separable resampler for packed 8-bit RGBA pixels
+*/
+#ifndef ___RESAMPLE_H___
+#define ___RESAMPLE_H___
+
+typedef enum {
+    RESAMPLE_POINT,
+    RESAMPLE_BOX,
+    RESAMPLE_TRIANGLE,
+    RESAMPLE_HERMITE,
+    RESAMPLE_CATROM,
+    RESAMPLE_MITCHELL,
+    RESAMPLE_LANCZOS
+} ResampleFilter_e;
+
+// select kernel by name: "avx2", "sse2", "scalar" or NULL for the best
+// one the cpu supports. returns -1 if not available.
+int resampleSelect( const char *name );
+// name of selected kernel
+const char *resampleKernel( void );
+
+// resample sw x sh pixels of src into dw x dh pixels of dst, 4 bytes
+// per pixel. returns -1 and sets errno on failure.
+int resampleRGBA( const unsigned char *src, unsigned long sw, unsigned long sh,
+                  unsigned char *dst, unsigned long dw, unsigned long dh,
+                  ResampleFilter_e filter );
+
+// resample color channels weighted by alpha
+void premultiplyRGBA( unsigned char *pixels, unsigned long npix );
+void unpremultiplyRGBA( unsigned char *pixels, unsigned long npix );
+
+#endif